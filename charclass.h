@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+    Classes of characters, looked up by byte in CHAR_CLASS so that each test
+    is a single load. Bytes outside of ASCII belong to no class, and spaces are
+    those of isspace() in the C locale.
+*/
+#define CC_MARKER  0x0001 /* may start markup, as listed in MARKERS */
+#define CC_SPACE   0x0002
+#define CC_DIGIT   0x0004
+#define CC_HEX     0x0008
+#define CC_ALNUM   0x0010
+#define CC_UPPER   0x0020
+#define CC_SCHEME  0x0040 /* may be part of a URI scheme */
+#define CC_URI_END 0x0080 /* ends a URI whatever the context */
+
+#define CC_MARKER_SPACE (CC_MARKER | CC_SPACE)
+#define CC_DIGIT_CHAR   (CC_DIGIT | CC_HEX | CC_ALNUM | CC_SCHEME)
+#define CC_HEX_UPPER    (CC_HEX | CC_ALNUM | CC_UPPER | CC_SCHEME)
+#define CC_UPPER_CHAR   (CC_ALNUM | CC_UPPER | CC_SCHEME)
+#define CC_HEX_LOWER    (CC_HEX | CC_ALNUM | CC_SCHEME)
+#define CC_LOWER_CHAR   (CC_ALNUM | CC_SCHEME)
+
+static const uint16_t CHAR_CLASS[256] = {
+    ['\0'] = CC_MARKER | CC_URI_END,
+    ['\t'] = CC_SPACE,
+    ['\n'] = CC_MARKER | CC_SPACE | CC_URI_END,
+    ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE,
+    [' '] = CC_SPACE | CC_URI_END,
+    ['!'] = CC_MARKER,
+    ['"'] = CC_URI_END,
+    ['#'] = CC_MARKER,
+    ['&'] = CC_MARKER,
+    ['\''] = CC_MARKER,
+    ['*'] = CC_MARKER,
+    ['+'] = CC_SCHEME,
+    ['-'] = CC_MARKER | CC_SCHEME,
+    ['.'] = CC_SCHEME,
+    ['/'] = CC_MARKER,
+    ['0'] = CC_DIGIT_CHAR,
+    ['1'] = CC_DIGIT_CHAR,
+    ['2'] = CC_DIGIT_CHAR,
+    ['3'] = CC_DIGIT_CHAR,
+    ['4'] = CC_DIGIT_CHAR,
+    ['5'] = CC_DIGIT_CHAR,
+    ['6'] = CC_DIGIT_CHAR,
+    ['7'] = CC_DIGIT_CHAR,
+    ['8'] = CC_DIGIT_CHAR,
+    ['9'] = CC_DIGIT_CHAR,
+    [':'] = CC_MARKER,
+    [';'] = CC_MARKER,
+    ['<'] = CC_MARKER | CC_URI_END,
+    ['='] = CC_MARKER,
+    ['>'] = CC_MARKER | CC_URI_END,
+    ['A'] = CC_HEX_UPPER,
+    ['B'] = CC_HEX_UPPER,
+    ['C'] = CC_HEX_UPPER,
+    ['D'] = CC_HEX_UPPER,
+    ['E'] = CC_HEX_UPPER,
+    ['F'] = CC_HEX_UPPER,
+    ['G'] = CC_UPPER_CHAR,
+    ['H'] = CC_UPPER_CHAR,
+    ['I'] = CC_UPPER_CHAR,
+    ['J'] = CC_UPPER_CHAR,
+    ['K'] = CC_UPPER_CHAR,
+    ['L'] = CC_UPPER_CHAR,
+    ['M'] = CC_UPPER_CHAR,
+    ['N'] = CC_UPPER_CHAR,
+    ['O'] = CC_UPPER_CHAR,
+    ['P'] = CC_UPPER_CHAR,
+    ['Q'] = CC_UPPER_CHAR,
+    ['R'] = CC_UPPER_CHAR,
+    ['S'] = CC_UPPER_CHAR,
+    ['T'] = CC_UPPER_CHAR,
+    ['U'] = CC_UPPER_CHAR,
+    ['V'] = CC_UPPER_CHAR,
+    ['W'] = CC_UPPER_CHAR,
+    ['X'] = CC_UPPER_CHAR,
+    ['Y'] = CC_UPPER_CHAR,
+    ['Z'] = CC_UPPER_CHAR,
+    ['['] = CC_MARKER | CC_URI_END,
+    [']'] = CC_MARKER | CC_URI_END,
+    ['a'] = CC_HEX_LOWER,
+    ['b'] = CC_HEX_LOWER,
+    ['c'] = CC_HEX_LOWER,
+    ['d'] = CC_HEX_LOWER,
+    ['e'] = CC_HEX_LOWER,
+    ['f'] = CC_HEX_LOWER,
+    ['g'] = CC_LOWER_CHAR,
+    ['h'] = CC_LOWER_CHAR,
+    ['i'] = CC_LOWER_CHAR,
+    ['j'] = CC_LOWER_CHAR,
+    ['k'] = CC_LOWER_CHAR,
+    ['l'] = CC_LOWER_CHAR,
+    ['m'] = CC_LOWER_CHAR,
+    ['n'] = CC_LOWER_CHAR,
+    ['o'] = CC_LOWER_CHAR,
+    ['p'] = CC_LOWER_CHAR,
+    ['q'] = CC_LOWER_CHAR,
+    ['r'] = CC_LOWER_CHAR,
+    ['s'] = CC_LOWER_CHAR,
+    ['t'] = CC_LOWER_CHAR,
+    ['u'] = CC_LOWER_CHAR,
+    ['v'] = CC_LOWER_CHAR,
+    ['w'] = CC_LOWER_CHAR,
+    ['x'] = CC_LOWER_CHAR,
+    ['y'] = CC_LOWER_CHAR,
+    ['z'] = CC_LOWER_CHAR,
+    ['{'] = CC_MARKER,
+    ['|'] = CC_MARKER,
+    ['}'] = CC_MARKER,
+};
+
+/*
+    Return whether the character belongs to any of the given classes.
+*/
+static inline int
+char_is(char c, uint16_t classes)
+{
+    return (CHAR_CLASS[(unsigned char) c] & classes) != 0;
+}
+
+/*
+    Return the character in lower case, if it is an ASCII letter.
+*/
+static inline char
+char_lower(char c)
+{
+    return char_is(c, CC_UPPER) ? c + ('a' - 'A') : c;
+}
@@ -22,8 +22,8 @@ SOFTWARE.
 
 #pragma once
 
-#include "avl_tree.h"
 #include "definitions.h"
+#include "memoryarena.h"
 #include "tokens.h"
 #include <assert.h>
 #include <ctype.h>
@@ -54,10 +54,15 @@ extern char** entitydefs;
 
 /* Structs */
 
+/*
+    A growable run of text. While everything written to it is a contiguous
+    run of the input, it only refers to that run and nothing is copied.
+*/
 typedef struct {
     char* data;
     size_t length;
     size_t capacity;
+    const char* span; /* if not NULL, the contents are here rather than in data */
 } Textbuffer;
 
 typedef struct {
@@ -72,35 +77,142 @@ typedef struct
     size_t capacity;
 } TokenList;
 
-struct Stack {
-    TokenList* tokenlist;
+/*
+    A frame of the tokenizer's stack. Frames live in an array indexed by
+    depth and keep their textbuffer when they are popped, so pushing onto a
+    depth that was used before does not allocate one again.
+
+    The tokens of every frame are kept in the tokenizer's shared token list.
+    Each frame starts past everything in use when it is pushed, after a few
+    free slots for the tokens that will be written ahead of it.
+*/
+typedef struct {
+    size_t start; /* index of the frame's first token in the shared list */
+    size_t len; /* number of tokens in the frame */
+    size_t reserved; /* free slots right before start */
     uint64_t context;
-    Textbuffer* textbuffer;
+    Textbuffer* textbuffer; /* pinned, reset when the frame is popped */
+    size_t text_offset; /* where the textbuffer's text starts in the input */
     StackIdent ident;
-    struct Stack* next;
-};
-typedef struct Stack Stack;
+    arena_mark_t mark; /* arena state before this stack was pushed */
+} Stack;
+
+/*
+    Reads this far past either end of padded input need no bounds checks.
+*/
+#define TOKENIZER_PADDING 16
 
 typedef struct {
     size_t length;
     const char* data;
+    bool padded; /* TOKENIZER_PADDING NUL bytes come before and after data */
 } TokenizerInput;
 
-typedef struct avl_tree_node avl_tree;
+/*
+    The tokens of a popped stack that were not written to the stack below it
+    yet. Until they are, they stay in the shared token list after that stack's
+    tokens, and are moved out of the way if it needs the room.
+*/
+typedef struct {
+    TokenList* tokens; /* what Tokenizer_pop() returned */
+    size_t start; /* index of the first token in the shared list */
+    int depth; /* depth of the stack they belong to */
+} PoppedStack;
 
+/*
+    A position at which the outermost stack holds exactly the tokens for the
+    text before head, used to recover when the arena's limit is reached.
+*/
 typedef struct {
-    StackIdent id;
-    struct avl_tree_node node;
-} route_tree_node;
+    int saved; /* whether a safe point was recorded during this parse */
+    size_t head; /* position in text */
+    size_t tokens; /* number of tokens in the stack */
+    size_t text; /* length of the stack's textbuffer */
+} SafePoint;
+
+/*
+    What is known about the line head is on, so that whether only spaces come
+    before head on its line can be answered without going back over the line
+    each time. Nothing from line_start up to scanned is a newline or NUL, and
+    line_start is at the start of the text, right after one, or right after a
+    character that is not a space. The text from line_start up to blank_end
+    is all spaces, and if blank_end is before scanned, the character there is
+    not a space. A blank_end before line_start means the line has more than
+    spaces before it.
+*/
+typedef struct {
+    size_t line_start; /* start of the part of the line that is known */
+    size_t blank_end; /* end of the spaces the line starts with */
+    size_t scanned; /* end of the part of the line that is known */
+} LineIndex;
+
+/*
+    Open-addressed hash set of the idents of routes known to fail. Empty slots
+    have a head of ROUTE_SET_EMPTY. The table lives in pinned arena memory.
+
+    Once the outermost stack has moved past a position, no route starting
+    before it is checked again. Such routes are dropped when the table fills
+    up, so its size follows the nesting window rather than the document.
+*/
+typedef struct {
+    StackIdent* slots; /* NULL until the first route is added */
+    size_t mask; /* number of slots minus one */
+    size_t count; /* number of idents in the set */
+    size_t floor; /* routes starting before this are never checked again */
+    size_t pruned; /* floor when routes were last dropped */
+} RouteSet;
+
+#define ROUTE_SET_EMPTY SIZE_MAX
+
+/*
+    A string that was given an ID by a StringTable.
+*/
+typedef struct {
+    const char* text; /* not NUL terminated, and not owned by the table */
+    uint32_t length;
+    uint32_t hash;
+} InternedString;
+
+/*
+    Open-addressed hash table that gives each distinct string a 32-bit ID, so
+    that strings seen many times can be compared as integers. IDs start at 1,
+    and 0 stands for no string. The table lives in pinned arena memory.
+
+    A table can be stacked on a base table that it only reads from, such as
+    one filled with common names and shared by every document. The base's
+    strings keep their IDs, and strings new to this table are numbered after
+    them, so the base must not change while it is shared.
+*/
+typedef struct StringTable {
+    const struct StringTable* base; /* read-only table looked in first, or NULL */
+    uint32_t first; /* number of strings in the bases, set by StringTable_init() */
+    InternedString* strings; /* this table's strings, in the order of their IDs */
+    uint32_t* slots; /* index into strings plus one, 0 for an empty slot */
+    size_t mask; /* number of slots minus one */
+    uint32_t len; /* number of strings, not counting the base's */
+    uint32_t size; /* number of strings allocated */
+} StringTable;
 
 typedef struct {
     TokenizerInput text; /* text to tokenize */
-    Stack* topstack; /* topmost stack */
+    Stack* topstack; /* topmost stack, or NULL if depth is 0 */
+    Stack* frames; /* stacks by depth, in pinned arena memory */
+    int frames_size; /* number of frames allocated */
+    TokenList tokens; /* tokens of all stacks, in pinned arena memory */
+    PoppedStack* popped; /* popped stacks still in tokens, oldest first */
+    size_t popped_len; /* number of popped stacks */
+    size_t popped_size; /* number of popped stacks allocated */
     size_t head; /* current position in text */
     int global; /* global context */
     int depth; /* stack recursion depth */
     int route_state; /* whether a BadRoute has been triggered */
     uint64_t route_context; /* context when the last BadRoute was triggered */
-    avl_tree* bad_routes; /* stack idents for routes known to fail */
+    RouteSet bad_routes; /* stack idents for routes known to fail */
+    StringTable names; /* names interned by this parse, on a base kept by reset */
     int skip_style_tags; /* temp fix for the sometimes broken tag parser */
+    SafePoint safe_point; /* last safe point of the outermost stack */
+    LineIndex line; /* line head was last asked about */
+    int degraded; /* whether text was left unparsed because of the arena limit */
+    uint32_t tokens_per_kb; /* tokens per KiB of input in recent documents */
+    size_t text_capacity; /* size the outermost textbuffer grew to last time */
 } Tokenizer;
@@ -1,8 +1,12 @@
-#include "avl_tree.c"
 #include "definitions.c"
 #include "memoryarena.c"
+#include "sourcemap.c"
+#include "stringtable.c"
 #include "tag_data.c"
 #include "textbuffer.c"
 #include "tok_parse.c"
 #include "tok_support.c"
-#include "tokenlist.c"
\ No newline at end of file
+#include "tokencolumns.c"
+#include "tokenfile.c"
+#include "tokenlist.c"
+#include "tokenstream.c"
\ No newline at end of file
@@ -1,111 +1,638 @@
 #include "memoryarena.h"
 #include "assert.h"
+#include "stdint.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
 
-#define ALLOCATIONS_INITIAL_SIZE  512
-#define ALLOCATIONS_RESIZE_FACTOR 2
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_HIGH_WATER (16 * ARENA_BLOCK_SIZE)
+#define ARENA_ALIGNMENT  8
+#define ARENA_ALIGN(sz)                                                                \
+    (((sz) + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1))
+
+/* Size classes are powers of two from 16 bytes up to ARENA_MAX_CLASS_SIZE. */
+#define ARENA_MIN_CLASS_SHIFT 4
+#define ARENA_MAX_CLASS_SIZE                                                           \
+    ((size_t) 1 << (ARENA_MIN_CLASS_SHIFT + ARENA_NUM_CLASSES - 1))
+
+struct memory_arena_block {
+    memory_arena_block_t *prev;
+    size_t size; /* usable bytes following this header */
+    size_t used;
+};
+
+/*
+    Every allocation is preceded by its usable size and category. For small
+    allocations the size is that of their class, which is all arena_free()
+    needs to put them back on the right free list.
+*/
+typedef struct {
+    uint64_t size : 55;
+    uint64_t pinned : 1;
+    uint64_t category : 8;
+} alloc_header_t;
+
+/*
+    A freed chunk records when it was freed, so that arena_release_to() only
+    has to look at chunks freed after the mark it is rolling back to.
+*/
+typedef struct free_chunk {
+    struct free_chunk *next;
+    size_t stamp;
+} free_chunk_t;
+
+#define BLOCK_DATA(b) ((char *) (b) + sizeof(memory_arena_block_t))
+#define CHUNK_BYTES(h) (sizeof(alloc_header_t) + (size_t) (h)->size)
+
+/*
+    Return the size class for an allocation of sz bytes, or -1 if it is too
+    large to be served from a free list.
+*/
+static inline int
+arena_size_class(size_t sz)
+{
+    if (sz > ARENA_MAX_CLASS_SIZE)
+        return -1;
+    if (sz <= ((size_t) 1 << ARENA_MIN_CLASS_SHIFT))
+        return 0;
+
+    sz = (sz - 1) >> ARENA_MIN_CLASS_SHIFT;
+#ifdef __GNUC__
+    return (int) (sizeof(unsigned long long) * 8) - __builtin_clzll(sz);
+#else
+    int cls = 0;
+    while (sz) {
+        sz >>= 1;
+        cls++;
+    }
+    return cls;
+#endif
+}
+
+#define CLASS_SIZE(cls) ((size_t) 1 << (ARENA_MIN_CLASS_SHIFT + (cls)))
+#define LARGE_LIST      ARENA_NUM_CLASSES
+
+/*
+    Push a new block onto the given chain, reusing a spare block if one is
+    large enough. Blocks for requests larger than block_size hold that one
+    request and are kept off the head chain, so that the block being bumped
+    from stays in use: ordinary ones go on the large chain and pinned ones
+    behind the current pinned block.
+*/
+static memory_arena_block_t *
+arena_new_block(memory_arena_t *a, memory_arena_block_t **chain, size_t min_size)
+{
+    memory_arena_block_t *b;
+    size_t size = a->block_size;
+
+    if (min_size > size)
+        size = min_size;
+    if (a->fixed || (a->limit != 0 && a->in_use != 0 && a->in_use + size > a->limit)) {
+        a->out_of_space = 1;
+        return NULL;
+    }
+    if (min_size <= a->block_size && a->spare != NULL) {
+        b = a->spare;
+        a->spare = b->prev;
+    } else {
+        b = malloc(sizeof(memory_arena_block_t) + size);
+        if (b == NULL) {
+            a->out_of_space = 1;
+            return NULL;
+        }
+        b->size = size;
+    }
+    if (min_size > a->block_size) {
+        if (chain == &a->head)
+            chain = &a->large;
+        else if (*chain != NULL)
+            chain = &(*chain)->prev;
+    }
+    b->prev = *chain;
+    b->used = 0;
+    *chain = b;
+    a->in_use += b->size;
+
+    return b;
+}
+
+/*
+    Hand a block that is no longer in use back to the spare list, or to the
+    system if it was an oversized one.
+*/
+static void
+arena_retire_block(memory_arena_t *a, memory_arena_block_t *b)
+{
+    a->in_use -= b->size;
+    if (b->size == a->block_size) {
+        b->prev = a->spare;
+        a->spare = b;
+    } else {
+        free(b);
+    }
+}
+
+static void
+arena_retire_chain(memory_arena_t *a, memory_arena_block_t **chain)
+{
+    while (*chain != NULL) {
+        memory_arena_block_t *b = *chain;
+        *chain = b->prev;
+        arena_retire_block(a, b);
+    }
+}
+
+static void
+arena_free_chain(memory_arena_block_t *b)
+{
+    while (b != NULL) {
+        memory_arena_block_t *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+}
 
 int
 arena_init(memory_arena_t *a)
 {
     assert(a);
 
-    a->allocations = malloc(ALLOCATIONS_INITIAL_SIZE * sizeof(void *));
-    if (a->allocations == NULL)
+    a->head = NULL;
+    a->large = NULL;
+    a->pinned = NULL;
+    a->spare = NULL;
+    a->block_size = ARENA_BLOCK_SIZE;
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->frees = 0;
+    a->high_water = ARENA_HIGH_WATER;
+    a->limit = 0;
+    a->in_use = 0;
+    a->fixed = 0;
+    a->out_of_space = 0;
+    memset(&a->stats, 0, sizeof(a->stats));
+    memset(&a->floor, 0, sizeof(a->floor));
+    a->base = arena_new_block(a, &a->head, 0);
+    if (a->base == NULL)
         return 1;
-    a->len = 0;
-    a->capacity = ALLOCATIONS_INITIAL_SIZE;
 
     return 0;
 }
 
-void *
-arena_alloc(memory_arena_t *a, size_t sz)
+/*
+    Set up an arena that allocates from the given buffer only. The buffer
+    becomes the arena's single block: ordinary allocations are bumped from
+    its start and pinned ones from its end. Return 1 if the buffer is too
+    small to be used at all.
+*/
+int
+arena_init_buffer(memory_arena_t *a, void *buf, size_t size)
 {
     assert(a);
-    assert(a->capacity > 0);
-    assert(a->len <= a->capacity);
+    assert(buf);
+
+    size_t skip = ARENA_ALIGN((uintptr_t) buf) - (uintptr_t) buf;
+    if (size < skip + sizeof(memory_arena_block_t) + ARENA_ALIGNMENT)
+        return 1;
+
+    memory_arena_block_t *b = (memory_arena_block_t *) ((char *) buf + skip);
+    b->prev = NULL;
+    b->size = size - skip - sizeof(memory_arena_block_t);
+    b->size &= ~((size_t) ARENA_ALIGNMENT - 1);
+    b->used = 0;
 
-    if (a->len == a->capacity) {
-        size_t new_size = a->capacity * ALLOCATIONS_RESIZE_FACTOR;
-        a->allocations = reallocarray(a->allocations, new_size, sizeof(void *));
-        if (a->allocations == NULL)
+    a->head = b;
+    a->base = b;
+    a->large = NULL;
+    a->pinned = NULL;
+    a->spare = NULL;
+    a->block_size = b->size;
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->frees = 0;
+    a->high_water = 0;
+    a->limit = 0;
+    a->in_use = b->size;
+    a->fixed = 1;
+    a->out_of_space = 0;
+    memset(&a->stats, 0, sizeof(a->stats));
+    memset(&a->floor, 0, sizeof(a->floor));
+
+    return 0;
+}
+
+/*
+    Carve a chunk of the given usable size out of the head of a chain.
+*/
+static inline void *
+arena_bump(memory_arena_t *a, memory_arena_block_t **chain, size_t size,
+           arena_category_t category)
+{
+    size_t need = sizeof(alloc_header_t) + size;
+    memory_arena_block_t *b = *chain;
+
+    if (b == NULL || b->size - b->used < need) {
+        b = arena_new_block(a, chain, need);
+        if (b == NULL)
             return NULL;
-        a->capacity = new_size;
     }
 
-    void *new_alloc = malloc(sz);
-    if (new_alloc == NULL)
-        return NULL;
-    a->allocations[a->len] = new_alloc;
-    a->len++;
+    alloc_header_t *h = (alloc_header_t *) (BLOCK_DATA(b) + b->used);
+    h->size = size;
+    h->pinned = chain == &a->pinned;
+    h->category = category;
+    b->used += need;
 
-    return new_alloc;
+    return h + 1;
+}
+
+/*
+    Count bytes newly handed out for the chunk with header h.
+*/
+static inline void
+arena_count_bytes(memory_arena_t *a, alloc_header_t *h, size_t bytes)
+{
+    a->stats.live += bytes;
+    if (a->stats.live > a->stats.peak)
+        a->stats.peak = a->stats.live;
+    a->stats.categories[h->category].bytes += bytes;
+}
+
+static inline void
+arena_count_alloc(memory_arena_t *a, arena_category_t category)
+{
+    a->stats.allocs++;
+    a->stats.categories[category].allocs++;
+}
+
+/*
+    Take the first freed large chunk of at least size bytes off its list.
+    Later chunks keep their order, which arena_release_to() relies on.
+*/
+static free_chunk_t *
+arena_take_large(memory_arena_t *a, size_t size)
+{
+    free_chunk_t **link = (free_chunk_t **) &a->free_lists[LARGE_LIST];
+
+    for (; *link != NULL; link = &(*link)->next) {
+        free_chunk_t *chunk = *link;
+        if (((alloc_header_t *) chunk - 1)->size >= size) {
+            *link = chunk->next;
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Allocate without counting the call, for use by arena_reallocarray().
+*/
+static void *
+arena_alloc_chunk(memory_arena_t *a, size_t sz, arena_category_t category)
+{
+    alloc_header_t *h;
+    int cls = arena_size_class(sz);
+    free_chunk_t *chunk;
+
+    if (cls < 0) {
+        chunk = arena_take_large(a, ARENA_ALIGN(sz));
+    } else {
+        chunk = a->free_lists[cls];
+        if (chunk != NULL)
+            a->free_lists[cls] = chunk->next;
+    }
+    if (chunk != NULL) {
+        h = (alloc_header_t *) chunk - 1;
+        h->pinned = 0;
+        h->category = category;
+    } else {
+        size_t size = cls < 0 ? ARENA_ALIGN(sz) : CLASS_SIZE(cls);
+        void *ptr = arena_bump(a, &a->head, size, category);
+        if (ptr == NULL)
+            return NULL;
+        h = (alloc_header_t *) ptr - 1;
+    }
+    arena_count_bytes(a, h, CHUNK_BYTES(h));
+
+    return h + 1;
 }
 
 void *
-arena_calloc(memory_arena_t *a, size_t nmemb, size_t size)
+arena_alloc(memory_arena_t *a, size_t sz, arena_category_t category)
 {
     assert(a);
-    assert(a->capacity > 0);
-    assert(a->len <= a->capacity);
+    assert(a->head);
+
+    void *ptr = arena_alloc_chunk(a, sz, category);
+    if (ptr != NULL)
+        arena_count_alloc(a, category);
 
-    if (a->len == a->capacity) {
-        size_t new_size = a->capacity * ALLOCATIONS_RESIZE_FACTOR;
-        a->allocations = reallocarray(a->allocations, new_size, sizeof(void *));
-        if (a->allocations == NULL)
+    return ptr;
+}
+
+/*
+    Pinned counterpart of arena_alloc_chunk().
+*/
+static void *
+arena_pinned_chunk(memory_arena_t *a, size_t sz, arena_category_t category)
+{
+    int cls = arena_size_class(sz);
+    size_t size = cls < 0 ? ARENA_ALIGN(sz) : CLASS_SIZE(cls);
+    alloc_header_t *h;
+
+    // Pinned allocations grow down from the end of the first block, out of
+    // reach of arena_release_to(), which never goes below the first block.
+    memory_arena_block_t *b = a->base;
+    size_t need = sizeof(alloc_header_t) + size;
+    if (b->size - b->used >= need) {
+        b->size -= need;
+
+        h = (alloc_header_t *) (BLOCK_DATA(b) + b->size);
+        h->size = size;
+        h->pinned = 1;
+        h->category = category;
+    } else if (a->fixed) {
+        a->out_of_space = 1;
+        return NULL;
+    } else {
+        void *ptr = arena_bump(a, &a->pinned, size, category);
+        if (ptr == NULL)
             return NULL;
-        a->capacity = new_size;
+        h = (alloc_header_t *) ptr - 1;
     }
+    arena_count_bytes(a, h, CHUNK_BYTES(h));
+
+    return h + 1;
+}
+
+/*
+    Allocate memory that is not given back by arena_release_to(), for data
+    that has to outlive the route it was created in. It is still released
+    by arena_clear() and may be passed to arena_free(). Resizing it with
+    arena_reallocarray() keeps it pinned.
+*/
+void *
+arena_alloc_pinned(memory_arena_t *a, size_t sz, arena_category_t category)
+{
+    assert(a);
+
+    void *ptr = arena_pinned_chunk(a, sz, category);
+    if (ptr != NULL)
+        arena_count_alloc(a, category);
+
+    return ptr;
+}
+
+void *
+arena_calloc(memory_arena_t *a, size_t nmemb, size_t size, arena_category_t category)
+{
+    assert(a);
 
-    void *new_alloc = calloc(nmemb, size);
+    if (size != 0 && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    void *new_alloc = arena_alloc(a, nmemb * size, category);
     if (new_alloc == NULL)
         return NULL;
-    a->allocations[a->len] = new_alloc;
-    a->len++;
+    memset(new_alloc, 0, nmemb * size);
 
     return new_alloc;
 }
 
+/*
+    Return whether ptr is the most recent allocation in the head block, in
+    which case it can be grown or released in place.
+*/
+static inline int
+arena_is_last(memory_arena_t *a, alloc_header_t *h)
+{
+    memory_arena_block_t *b = a->head;
+    return (char *) (h + 1) + (size_t) h->size == BLOCK_DATA(b) + b->used;
+}
+
+/*
+    Return whether the chunk with header h lies above the latest mark. Only
+    such chunks may be released in place, as arena_release_to() relies on
+    the head block not shrinking below a mark.
+*/
+static inline int
+arena_above_floor(memory_arena_t *a, alloc_header_t *h)
+{
+    return a->head != a->floor.block ||
+           (size_t) ((char *) h - BLOCK_DATA(a->head)) >= a->floor.used;
+}
+
+/*
+    Free without counting the call, for use by arena_reallocarray().
+*/
+static void
+arena_free_chunk(memory_arena_t *a, void *ptr)
+{
+    alloc_header_t *h = (alloc_header_t *) ptr - 1;
+    int cls = arena_size_class(h->size);
+
+    a->stats.live -= CHUNK_BYTES(h);
+    if (cls < 0 && arena_is_last(a, h) && arena_above_floor(a, h)) {
+        a->head->used -= CHUNK_BYTES(h);
+    } else {
+        free_chunk_t *chunk = ptr;
+        if (cls < 0)
+            cls = LARGE_LIST;
+        chunk->next = a->free_lists[cls];
+        chunk->stamp = a->frees++;
+        a->free_lists[cls] = chunk;
+    }
+}
+
 void *
 arena_reallocarray(memory_arena_t *a, void *ptr, size_t nmemb, size_t sz)
 {
     assert(a);
-    if (ptr == NULL)
+
+    if (sz != 0 && nmemb > SIZE_MAX / sz)
         return NULL;
+    if (ptr == NULL)
+        return arena_alloc(a, nmemb * sz, ARENA_OTHER);
 
-    for (int i = 0; i < a->len; i++) {
-        if (a->allocations[i] == ptr) {
-            void *new_alloc = reallocarray(a->allocations[i], nmemb, sz);
-            if (new_alloc == NULL)
-                return NULL;
+    alloc_header_t *h = (alloc_header_t *) ptr - 1;
+    size_t new_size = nmemb * sz;
 
-            a->allocations[i] = new_alloc;
+    if (new_size <= h->size)
+        return ptr;
 
-            return new_alloc;
-        }
+    /* Large allocations at the end of the head block can simply grow. */
+    memory_arena_block_t *b = a->head;
+    size_t aligned = ARENA_ALIGN(new_size);
+    if (arena_size_class(new_size) < 0 && arena_is_last(a, h) &&
+        arena_above_floor(a, h) && b->size - b->used >= aligned - h->size) {
+        b->used += aligned - h->size;
+        arena_count_bytes(a, h, aligned - h->size);
+        a->stats.resizes++;
+        h->size = aligned;
+        return ptr;
     }
 
-    return NULL;
+    void *new_alloc = h->pinned ? arena_pinned_chunk(a, new_size, h->category)
+                                : arena_alloc_chunk(a, new_size, h->category);
+    if (new_alloc == NULL)
+        return NULL;
+    memcpy(new_alloc, ptr, h->size);
+    arena_free_chunk(a, ptr);
+    a->stats.resizes++;
+
+    return new_alloc;
 }
 
+/*
+    Small allocations go back on the free list of their size class. Large
+    ones are given back to the head block if they are the most recent
+    allocation there, and otherwise go on the list of large chunks.
+*/
 void
 arena_free(memory_arena_t *a, void *ptr)
 {
     assert(a);
 
-    if (a->len == 0)
+    if (ptr == NULL)
         return;
 
-    for (int i = 0; i < a->len; i++) {
-        if (a->allocations[i] == ptr) {
-            free(ptr);
-            a->allocations[i] = NULL;
-            return;
+    a->stats.frees++;
+    arena_free_chunk(a, ptr);
+}
+
+/*
+    Record the current allocation point. Everything allocated after it can be
+    given back at once with arena_release_to().
+*/
+arena_mark_t
+arena_mark(memory_arena_t *a)
+{
+    assert(a);
+    assert(a->head);
+
+    arena_mark_t mark = {a->head, a->large, a->head->used, a->frees};
+    a->floor = mark;
+    return mark;
+}
+
+/*
+    Return whether ptr lies in the part of the chain allocated after mark.
+*/
+static int
+arena_after_mark(memory_arena_t *a, arena_mark_t mark, void *ptr)
+{
+    char *p = ptr;
+
+    for (memory_arena_block_t *b = a->large; b != mark.large; b = b->prev) {
+        if (p >= BLOCK_DATA(b) && p < BLOCK_DATA(b) + b->size)
+            return 1;
+    }
+    for (memory_arena_block_t *b = a->head;; b = b->prev) {
+        char *start = BLOCK_DATA(b);
+        if (b == mark.block)
+            return p >= start + mark.used && p < start + b->size;
+        if (p >= start && p < start + b->size)
+            return 1;
+    }
+}
+
+/*
+    Give back everything allocated since mark was taken, except pinned
+    allocations. Pointers into the released region must not be used, freed
+    or resized afterwards.
+*/
+void
+arena_release_to(memory_arena_t *a, arena_mark_t mark)
+{
+    assert(a);
+    assert(mark.block);
+    assert(a->head != mark.block || a->head->used >= mark.used);
+
+    // Everything bumped since the mark stops being live, apart from the
+    // chunks among it that were already freed.
+    size_t released = a->head->used;
+    for (memory_arena_block_t *b = a->head; b != mark.block; b = b->prev)
+        released += b->prev->used;
+    released -= mark.used;
+    for (memory_arena_block_t *b = a->large; b != mark.large; b = b->prev)
+        released += b->used;
+
+    // Chunks freed since the mark sit at the front of each list; drop the
+    // ones that are about to be handed out again by the bump pointer.
+    for (int cls = 0; cls <= LARGE_LIST; cls++) {
+        free_chunk_t **link = (free_chunk_t **) &a->free_lists[cls];
+        while (*link != NULL && (*link)->stamp >= mark.frees) {
+            if (arena_after_mark(a, mark, *link)) {
+                released -= CHUNK_BYTES((alloc_header_t *) *link - 1);
+                *link = (*link)->next;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    a->stats.live -= released;
+
+    while (a->head != mark.block) {
+        memory_arena_block_t *b = a->head;
+        a->head = b->prev;
+        arena_retire_block(a, b);
+    }
+    a->head->used = mark.used;
+    while (a->large != mark.large) {
+        memory_arena_block_t *b = a->large;
+        a->large = b->prev;
+        arena_retire_block(a, b);
+    }
+    a->floor = mark;
+}
+
+/*
+    Give back every allocation, pinned ones included, while keeping the
+    blocks around for the next user of the arena. Blocks beyond the
+    high_water limit are returned to the system. Return 1 if the arena could
+    not be set up again, in which case it is left empty as after
+    arena_clear().
+*/
+int
+arena_reset(memory_arena_t *a)
+{
+    assert(a);
+
+    a->out_of_space = 0;
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->frees = 0;
+    memset(&a->stats, 0, sizeof(a->stats));
+    memset(&a->floor, 0, sizeof(a->floor));
+    if (a->fixed) {
+        a->head->size = a->block_size;
+        a->head->used = 0;
+        return 0;
+    }
+
+    // Give the first block back the room its pinned allocations took.
+    a->base->size = a->block_size;
+    arena_retire_chain(a, &a->head);
+    arena_retire_chain(a, &a->large);
+    arena_retire_chain(a, &a->pinned);
+
+    // Keep at least one block, which becomes the new head.
+    size_t kept = 0;
+    memory_arena_block_t **link = &a->spare;
+    while (*link != NULL) {
+        if (kept == 0 || a->high_water == 0 || kept + a->block_size <= a->high_water) {
+            kept += a->block_size;
+            link = &(*link)->prev;
+        } else {
+            memory_arena_block_t *b = *link;
+            *link = b->prev;
+            free(b);
         }
     }
+
+    a->base = arena_new_block(a, &a->head, 0);
+    if (a->base == NULL)
+        return 1;
+
+    return 0;
 }
 
 void
@@ -113,14 +640,29 @@ arena_clear(memory_arena_t *a)
 {
     assert(a);
 
-    for (int i = 0; i < a->len; i++) {
-        if (a->allocations[i] != NULL)
-            free(a->allocations[i]);
-    }
+    if (!a->fixed)
+        arena_free_chain(a->head);
+    arena_free_chain(a->large);
+    arena_free_chain(a->pinned);
+    arena_free_chain(a->spare);
 
-    free(a->allocations);
+    a->head = NULL;
+    a->base = NULL;
+    a->large = NULL;
+    a->pinned = NULL;
+    a->spare = NULL;
+    a->in_use = 0;
+    a->stats.live = 0;
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+}
 
-    a->allocations = NULL;
-    a->capacity = 0;
-    a->len = 0;
-}
\ No newline at end of file
+/*
+    Return a copy of the arena's counters.
+*/
+arena_stats_t
+arena_stats(const memory_arena_t *a)
+{
+    assert(a);
+
+    return a->stats;
+}
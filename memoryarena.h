@@ -3,17 +3,95 @@
 
 #include "stddef.h"
 
+typedef struct memory_arena_block memory_arena_block_t;
+
+#define ARENA_NUM_CLASSES 12
+
+/*
+    What an allocation is used for, as counted by the arena's statistics.
+*/
+typedef enum {
+    ARENA_OTHER,
+    ARENA_STACK,
+    ARENA_TOKENLIST,
+    ARENA_TEXTBUFFER,
+    ARENA_TAGDATA,
+    ARENA_TEXT, /* exported text owned by tokens */
+    ARENA_BAD_ROUTE, /* memoized failed routes */
+    ARENA_STRINGS, /* interned strings */
+    ARENA_NUM_CATEGORIES
+} arena_category_t;
+
+typedef struct {
+    size_t allocs; /* allocations made */
+    size_t bytes; /* bytes handed out, including growth by resizing */
+} arena_category_stats_t;
+
+/*
+    Allocation counters. They are zeroed by arena_init() and arena_reset(), so
+    after a parse they describe that parse alone. Byte counts include the
+    header and size class rounding of every chunk.
+*/
+typedef struct {
+    size_t live; /* bytes held by allocations right now */
+    size_t peak; /* highest value live has reached */
+    size_t allocs; /* calls to the allocation functions */
+    size_t resizes; /* calls to arena_reallocarray() that grew a chunk */
+    size_t frees; /* calls to arena_free() */
+    arena_category_stats_t categories[ARENA_NUM_CATEGORIES];
+} arena_stats_t;
+
+/*
+    A point in the arena's allocation history to roll back to.
+*/
+typedef struct {
+    memory_arena_block_t* block;
+    memory_arena_block_t* large;
+    size_t used;
+    size_t frees;
+} arena_mark_t;
+
+/*
+    Chunked bump allocator. Memory is carved out of large blocks and is only
+    returned to the system as whole blocks by arena_clear(). Freed small
+    allocations are kept on per-size-class free lists and handed out again
+    by the next allocation of the same class. Freed large ones share one
+    more list and go to the first later allocation they are big enough for.
+
+    An arena set up with arena_init_buffer() never calls malloc() and works
+    out of the caller's buffer alone. When that runs out, allocations fail
+    and out_of_space is set. The same happens when a limit is set and the
+    blocks in use would grow beyond it.
+*/
 typedef struct {
-    void** allocations;
-    size_t len;
-    size_t capacity;
+    memory_arena_block_t* head; /* block currently being allocated from */
+    memory_arena_block_t* base; /* first block, whose end holds pinned allocations */
+    memory_arena_block_t* large; /* blocks holding a single oversized allocation */
+    memory_arena_block_t* pinned; /* blocks for pinned allocations that did not fit */
+    memory_arena_block_t* spare; /* released blocks kept for reuse */
+    size_t block_size; /* default size of newly allocated blocks */
+    void* free_lists[ARENA_NUM_CLASSES + 1]; /* freed chunks, by size class, then large */
+    size_t frees; /* number of arena_free() calls, used to stamp chunks */
+    size_t high_water; /* bytes of blocks kept by arena_reset(), 0 for no limit */
+    size_t limit; /* most bytes of blocks in use at once, 0 for no limit */
+    size_t in_use; /* bytes of blocks holding allocations */
+    arena_mark_t floor; /* latest mark, which frees never give back memory below */
+    int fixed; /* whether memory comes from a caller-provided buffer */
+    int out_of_space; /* set when an allocation could not be satisfied */
+    arena_stats_t stats;
 } memory_arena_t;
 
 int arena_init(memory_arena_t*);
-void* arena_alloc(memory_arena_t*, size_t);
-void* arena_calloc(memory_arena_t*, size_t, size_t);
+int arena_init_buffer(memory_arena_t*, void*, size_t);
+void* arena_alloc(memory_arena_t*, size_t, arena_category_t);
+void* arena_calloc(memory_arena_t*, size_t, size_t, arena_category_t);
 void* arena_reallocarray(memory_arena_t*, void*, size_t, size_t);
+void* arena_alloc_pinned(memory_arena_t*, size_t, arena_category_t);
 void arena_free(memory_arena_t*, void*);
+arena_mark_t arena_mark(memory_arena_t*);
+void arena_release_to(memory_arena_t*, arena_mark_t);
+int arena_reset(memory_arena_t*);
 void arena_clear(memory_arena_t*);
+arena_stats_t arena_stats(const memory_arena_t*);
 
-#endif // __MEMORY_ARENA_H
\ No newline at end of file
+#endif // __MEMORY_ARENA_H
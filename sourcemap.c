@@ -0,0 +1,65 @@
+#include "sourcemap.h"
+#include "common.h"
+#include "memoryarena.h"
+#include "tokenlist.h"
+
+/*
+    Build the source map of the given tokens, which were read from an input
+    of the given length. Return NULL if it could not be allocated.
+*/
+SourceMap *
+SourceMap_new(memory_arena_t *a, const TokenList *tokens, size_t length)
+{
+    uint32_t *match = TokenList_match(a, tokens);
+    if (!match)
+        return NULL;
+
+    size_t size = sizeof(SourceMap) + tokens->len * 2 * sizeof(size_t);
+    SourceMap *self = arena_alloc(a, size, ARENA_TOKENLIST);
+    if (!self) {
+        arena_free(a, match);
+        return NULL;
+    }
+    self->starts = (size_t *) (self + 1);
+    self->ends = self->starts + tokens->len;
+    self->len = tokens->len;
+
+    // Offsets only go up as the tokens are written, but are clamped all the
+    // same so that the search over them is always well defined.
+    size_t start = 0;
+    for (size_t i = 0; i < tokens->len; i++) {
+        if (tokens->tokens[i].offset > start)
+            start = tokens->tokens[i].offset;
+        self->starts[i] = start < length ? start : length;
+    }
+
+    // Closing tokens come after their openers, so going backwards their ends
+    // are known by the time the openers are reached.
+    size_t end = length;
+    for (size_t i = tokens->len; i-- > 0;) {
+        self->ends[i] = match[i] > i ? self->ends[match[i]] : end;
+        end = self->starts[i];
+    }
+    arena_free(a, match);
+    return self;
+}
+
+/*
+    Return the index of the innermost token at the given offset, or the
+    number of tokens if the offset comes before all of them.
+*/
+size_t
+SourceMap_find(const SourceMap *self, size_t offset)
+{
+    size_t low = 0, high = self->len;
+
+    // Find the first token that starts past the offset.
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (self->starts[mid] <= offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low ? low - 1 : self->len;
+}
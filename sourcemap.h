@@ -0,0 +1,20 @@
+#pragma once
+
+#include "common.h"
+#include "memoryarena.h"
+
+/*
+    Where the tokens of a list came from in the input. The tokens follow the
+    input in order, so the token at an offset is the last one that starts at
+    or before it, and is found by a binary search over starts. A construct
+    ends where its closing token does, so its range covers everything in it.
+    Any other token ends where the next one starts.
+*/
+typedef struct {
+    size_t* starts; /* offset where each token starts, never decreasing */
+    size_t* ends; /* offset past the end of each token */
+    size_t len; /* number of tokens */
+} SourceMap;
+
+SourceMap* SourceMap_new(memory_arena_t*, const TokenList*, size_t length);
+size_t SourceMap_find(const SourceMap*, size_t offset);
@@ -0,0 +1,160 @@
+#include "stringtable.h"
+#include "common.h"
+#include "memoryarena.h"
+
+#define STRING_TABLE_INITIAL_SIZE 64
+
+/*
+    Hash a string with FNV-1a.
+*/
+static inline uint32_t
+string_hash(const char *text, size_t length)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char) text[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+    Return the slot holding the string, or the empty slot where it would go.
+*/
+static uint32_t *
+string_table_slot(const StringTable *self, const char *text, size_t length,
+                  uint32_t hash)
+{
+    size_t i = hash & self->mask;
+
+    while (1) {
+        uint32_t *slot = &self->slots[i];
+        if (!*slot)
+            return slot;
+        const InternedString *s = &self->strings[*slot - 1];
+        if (s->hash == hash && s->length == length && !memcmp(s->text, text, length))
+            return slot;
+        i = (i + 1) & self->mask;
+    }
+}
+
+/*
+    Start an empty table on top of the given base, which may be NULL.
+*/
+void
+StringTable_init(StringTable *self, const StringTable *base)
+{
+    self->base = base;
+    self->first = base ? base->first + base->len : 0;
+    self->strings = NULL;
+    self->slots = NULL;
+    self->mask = 0;
+    self->len = 0;
+    self->size = 0;
+}
+
+/*
+    Look the string up in the table and its bases, given its hash.
+*/
+static uint32_t
+string_table_lookup(const StringTable *self, const char *text, size_t length,
+                    uint32_t hash)
+{
+    for (; self; self = self->base) {
+        if (!self->slots)
+            continue;
+        uint32_t index = *string_table_slot(self, text, length, hash);
+        if (index)
+            return self->first + index;
+    }
+    return 0;
+}
+
+/*
+    Return the ID of the string, or 0 if neither the table nor its bases have
+    it.
+*/
+uint32_t
+StringTable_find(const StringTable *self, const char *text, size_t length)
+{
+    return string_table_lookup(self, text, length, string_hash(text, length));
+}
+
+/*
+    Move the table into the given number of slots. Return -1 if they could not
+    be allocated, in which case the table is left as it was.
+*/
+static int
+string_table_resize(memory_arena_t *a, StringTable *self, size_t size)
+{
+    uint32_t *slots = arena_alloc_pinned(a, size * sizeof(uint32_t), ARENA_STRINGS);
+    if (!slots)
+        return -1;
+    memset(slots, 0, size * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < self->len; i++) {
+        size_t j = self->strings[i].hash & (size - 1);
+        while (slots[j])
+            j = (j + 1) & (size - 1);
+        slots[j] = i + 1;
+    }
+    arena_free(a, self->slots);
+    self->slots = slots;
+    self->mask = size - 1;
+    return 0;
+}
+
+/*
+    Return the ID of the string, adding it to the table if it is not there or
+    in a base. The text is not copied, so it must outlive the table. Return 0
+    if there was no room for it.
+*/
+uint32_t
+StringTable_add(memory_arena_t *a, StringTable *self, const char *text, size_t length)
+{
+    if (length > UINT32_MAX)
+        return 0;
+    uint32_t hash = string_hash(text, length);
+    uint32_t id = string_table_lookup(self, text, length, hash);
+    if (id)
+        return id;
+
+    // Keep the table at most half full, so probe sequences stay short.
+    if (!self->slots || (self->len + 1) * 2 > self->mask + 1) {
+        size_t size = self->slots ? (self->mask + 1) * 2 : STRING_TABLE_INITIAL_SIZE;
+        if (string_table_resize(a, self, size))
+            return 0;
+    }
+
+    if (self->len == self->size) {
+        uint32_t size = self->size ? self->size * 2 : STRING_TABLE_INITIAL_SIZE / 2;
+        InternedString *strings =
+            self->strings
+                ? arena_reallocarray(a, self->strings, size, sizeof(InternedString))
+                : arena_alloc_pinned(a, size * sizeof(InternedString), ARENA_STRINGS);
+        if (!strings)
+            return 0;
+        self->strings = strings;
+        self->size = size;
+    }
+
+    uint32_t *slot = string_table_slot(self, text, length, hash);
+    self->strings[self->len] = (InternedString) {text, (uint32_t) length, hash};
+    *slot = ++self->len;
+    return self->first + self->len;
+}
+
+/*
+    Return the string with the given ID, or NULL if there is none.
+*/
+const InternedString *
+StringTable_get(const StringTable *self, uint32_t id)
+{
+    if (!id)
+        return NULL;
+    while (id <= self->first)
+        self = self->base;
+    if (id > self->first + self->len)
+        return NULL;
+    return &self->strings[id - self->first - 1];
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+#include "memoryarena.h"
+
+void StringTable_init(StringTable*, const StringTable* base);
+uint32_t StringTable_find(const StringTable*, const char*, size_t);
+uint32_t StringTable_add(memory_arena_t*, StringTable*, const char*, size_t);
+const InternedString* StringTable_get(const StringTable*, uint32_t id);
@@ -37,9 +37,10 @@ TagData_new(memory_arena_t *a, TokenizerInput *text)
         return NULL;                                                                   \
     }
 
-    TagData *self = arena_alloc(a, sizeof(TagData));
+    TagData *self = arena_alloc(a, sizeof(TagData), ARENA_TAGDATA);
     if (!self)
         return NULL;
+    self->pad_first = self->pad_before_eq = self->pad_after_eq = NULL;
     self->context = TAG_NAME;
     ALLOC_BUFFER(self->pad_first)
     ALLOC_BUFFER(self->pad_before_eq)
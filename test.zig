@@ -4,7 +4,14 @@ const eqlStr = std.testing.expectEqualStrings;
 
 const c = @cImport({
     @cInclude("common.h");
+    @cInclude("contexts.h");
+    @cInclude("sourcemap.h");
+    @cInclude("stringtable.h");
     @cInclude("tok_parse.h");
+    @cInclude("tokencolumns.h");
+    @cInclude("tokenfile.h");
+    @cInclude("tokenlist.h");
+    @cInclude("tokenstream.h");
     @cInclude("tokens.h");
 });
 
@@ -15,7 +22,7 @@ export fn printTokens(tokenlist: c.TokenList) void {
     while (i < tokenlist.len) : (i += 1) {
         const token = tokenlist.tokens[i];
         if (token.type == c.Text) {
-            std.debug.print("Text(\"{s}\")", .{@as([*c]const u8, @ptrCast(token.ctx.data))});
+            std.debug.print("Text(\"{s}\")", .{textFromTextTok(token)});
         } else if (token.type == c.ExternalLinkOpen) {
             std.debug.print("ExternalLinkOpen({})", .{token.ctx.external_link_open.brackets});
         } else {
@@ -28,6 +35,11 @@ export fn printTokens(tokenlist: c.TokenList) void {
 }
 
 fn textFromTextTok(t: c.Token) []const u8 {
+    return @as([*]const u8, @ptrCast(t.ctx.data))[0..t.length];
+}
+
+// Expected tokens are written with NUL-terminated literals and no length.
+fn textFromExpectedTok(t: c.Token) []const u8 {
     return std.mem.sliceTo(@as([*c]u8, @ptrCast(t.ctx.data)), 0);
 }
 
@@ -66,7 +78,7 @@ fn expectTokensEql(expected: []const c.Token, actual: c.TokenList) !void {
         const actual_token = actual.tokens[i];
         try expect(expected_token.type == actual_token.type);
         if (expected_token.type == c.Text) {
-            try eqlStr(textFromTextTok(expected_token), textFromTextTok(actual_token));
+            try eqlStr(textFromExpectedTok(expected_token), textFromTextTok(actual_token));
         }
     }
     try expect(expected.len == actual.len);
@@ -134,6 +146,612 @@ test "a lot of text, requiring proper storage in the C tokenizer" {
     try expectTextTokEql(txt, tokenlist.tokens[0]);
 }
 
+// *****************
+// Memory management
+// *****************
+
+test "reset tokenizer and arena between documents" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+
+    // The failed template route must not be remembered for the next document.
+    const first = "{{foo";
+    try expect(c.Tokenizer_reset(&a, &tokenizer, first.ptr, first.len) == 0);
+    const tokens1 = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+    try expect(tokens1.len == 1);
+    try expectTextTokEql("{{foo", tokens1.tokens[0]);
+
+    const second = "{{foo}}";
+    try expect(c.Tokenizer_reset(&a, &tokenizer, second.ptr, second.len) == 0);
+    const tokens2 = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+
+    const expected = [_]c.Token{
+        .{ .type = c.TemplateOpen },
+        .{ .type = c.Text, .ctx = .{ .data = cText("foo") } },
+        .{ .type = c.TemplateClose },
+    };
+    try expectTokensEql(&expected, tokens2);
+}
+
+test "parse input padded with NUL bytes" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "{{foo}}";
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    try expect(c.TokenizerInput_pad(&a, &tokenizer.text) == 0);
+    try expect(tokenizer.text.padded);
+    try expect(tokenizer.text.data != txt.ptr);
+    try expect((tokenizer.text.data - 1)[0] == 0);
+    try expect(tokenizer.text.data[txt.len + c.TOKENIZER_PADDING - 1] == 0);
+    const tokens = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+
+    const expected = [_]c.Token{
+        .{ .type = c.TemplateOpen },
+        .{ .type = c.Text, .ctx = .{ .data = cText("foo") } },
+        .{ .type = c.TemplateClose },
+    };
+    try expectTokensEql(&expected, tokens);
+
+    // The next document is not taken to be padded.
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    try expect(!tokenizer.text.padded);
+}
+
+test "tables only start after leading whitespace" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    // Each {| looks back along its line, past what the one before it saw.
+    const txt = "a {| b  {|\nc {|";
+    const tokens = tokenize_arena(&a, txt);
+    try expect(tokens.len == 1);
+    try expectTextTokEql(txt, tokens.tokens[0]);
+}
+
+test "size the token list from earlier documents" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "{{t|a=[[b]]}} ''c'' text\n" ** 500;
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    const tokens1 = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+    try expect(c.arena_stats(&a).resizes > 0);
+
+    // The second document is given room for all of its tokens up front.
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    try expect(tokenizer.tokens_per_kb > 0);
+    const tokens2 = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+    try expect(tokens2.len == tokens1.len);
+    try expect(c.arena_stats(&a).resizes == 0);
+
+    // A list is created with the room it is asked for.
+    const list = c.TokenList_new(&a, 1000);
+    try expect(list != null and list.*.capacity == 1000);
+    var token = std.mem.zeroes(c.Token);
+    for (0..1000) |_| try expect(c.TokenList_append(&a, list, &token) == 0);
+    try expect(list.*.capacity == 1000);
+}
+
+test "arena reset keeps memory below the high water mark" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+    a.high_water = 1;
+
+    var i: u32 = 0;
+    while (i < 64) : (i += 1) {
+        try expect(c.arena_alloc(&a, 48 * 1024, c.ARENA_OTHER) != null);
+    }
+    try expect(c.arena_reset(&a) == 0);
+    try expect(a.spare == null);
+
+    const tokenlist = tokenize_arena(&a, "foobar");
+    try expect(tokenlist.len == 1);
+    try expectTextTokEql("foobar", tokenlist.tokens[0]);
+}
+
+test "oversized allocations leave the head block in use" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const head = a.head;
+    const mark = c.arena_mark(&a);
+    try expect(c.arena_alloc(&a, 200 * 1024, c.ARENA_OTHER) != null);
+    try expect(a.large != null);
+    try expect(a.head == head);
+
+    c.arena_release_to(&a, mark);
+    try expect(a.large == null);
+    try expect(c.arena_stats(&a).live == 0);
+}
+
+test "roll back past a chunk freed after the mark" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const ptr = c.arena_alloc(&a, 40000, c.ARENA_OTHER);
+    try expect(ptr != null);
+    const mark = c.arena_mark(&a);
+    c.arena_free(&a, ptr);
+
+    // The freed chunk lies before the mark and must not come back to life.
+    c.arena_release_to(&a, mark);
+    try expect(c.arena_stats(&a).live == 0);
+    const next = c.arena_alloc(&a, 100, c.ARENA_OTHER);
+    try expect(@intFromPtr(next) >= @intFromPtr(ptr) + 40000);
+}
+
+test "grow a chunk from before the mark and roll back" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const ptr = c.arena_alloc(&a, 40000, c.ARENA_OTHER);
+    try expect(ptr != null);
+    const mark = c.arena_mark(&a);
+
+    // Growing in place would reach past the mark, so the chunk is moved.
+    const grown = c.arena_reallocarray(&a, ptr, 50000, 1);
+    try expect(grown != null);
+    c.arena_release_to(&a, mark);
+
+    const next = c.arena_alloc(&a, 8000, c.ARENA_OTHER);
+    try expect(next != null);
+    const start = @intFromPtr(next);
+    try expect(start + 8000 <= @intFromPtr(grown) or start >= @intFromPtr(grown) + 50000);
+}
+
+test "drop the stacks a failed tag left open" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    // A push inside the tag runs into a memoized route, so the tag's route
+    // fails while its own stack is still open.
+    const txt = "<a <a =<!--<a =\n''";
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    const tokens = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+    try expect(tokenizer.depth == 0);
+    try expect(tokens.len == 1);
+    try expectTextTokEql(txt, tokens.tokens[0]);
+
+    // Once the stacks are dropped, rolling back gives back what the tag and
+    // the stacks inside it allocated.
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    try expect(c.Tokenizer_push(&a, &tokenizer, 0) == 0);
+    try expect(c.Tokenizer_push(&a, &tokenizer, c.LC_TAG_OPEN) == 0);
+    try expect(c.Tokenizer_push(&a, &tokenizer, c.LC_TAG_ATTR) == 0);
+    c.Tokenizer_drop_stacks(&tokenizer, 1);
+
+    const live = c.arena_stats(&a).live;
+    const mark = c.arena_mark(&a);
+    try expect(c.Tokenizer_push(&a, &tokenizer, c.LC_TAG_OPEN) == 0);
+    try expect(c.arena_alloc(&a, 64, c.ARENA_TAGDATA) != null);
+    try expect(c.Tokenizer_push(&a, &tokenizer, c.LC_TAG_ATTR) == 0);
+    try expect(c.Tokenizer_emit_run(&a, &tokenizer, txt.ptr, 3) == 0);
+    c.Tokenizer_drop_stacks(&tokenizer, 1);
+    c.arena_release_to(&a, mark);
+    try expect(tokenizer.depth == 1);
+    try expect(tokenizer.tokens.len == 0);
+    try expect(c.arena_stats(&a).live == live);
+}
+
+test "remember many bad routes" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "[[a|{{b" ** 40;
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    const tokenlist = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+
+    // More routes than fit in the initial table.
+    try expect(tokenizer.bad_routes.count > 64);
+    try expect(tokenlist.len == 1);
+    try expectTextTokEql(txt, tokenlist.tokens[0]);
+}
+
+test "forget bad routes the parser has moved past" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "[[a]\n" ** 2000;
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    const tokenlist = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+
+    try expect(tokenizer.bad_routes.mask < 64);
+    try expect(tokenlist.len == 1);
+    try expectTextTokEql(txt, tokenlist.tokens[0]);
+}
+
+test "arena statistics describe the last parse" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    _ = tokenize_arena(&a, "{{foo");
+    var stats = c.arena_stats(&a);
+    try expect(stats.live > 0);
+    try expect(stats.peak >= stats.live);
+    // The failed template is dropped by rolling the arena back, not freed.
+    try expect(stats.frees == 0);
+    try expect(stats.categories[c.ARENA_STACK].allocs > 0);
+    // The braces are written as text straight from the input.
+    try expect(stats.categories[c.ARENA_TEXT].allocs == 0);
+    try expect(stats.categories[c.ARENA_BAD_ROUTE].allocs == 1);
+
+    var total: usize = 0;
+    for (stats.categories) |category| total += category.allocs;
+    try expect(total == stats.allocs);
+
+    try expect(c.arena_reset(&a) == 0);
+    stats = c.arena_stats(&a);
+    try expect(stats.live == 0);
+    try expect(stats.peak == 0);
+    try expect(stats.allocs == 0);
+}
+
+test "freed large allocations stop counting as live" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const ptr = c.arena_alloc(&a, 40000, c.ARENA_OTHER);
+    try expect(c.arena_alloc(&a, 100, c.ARENA_OTHER) != null);
+    const live = c.arena_stats(&a).live;
+
+    // The chunk is not the last one, so it is kept for the next large
+    // allocation that fits.
+    c.arena_free(&a, ptr);
+    try expect(c.arena_stats(&a).live < live);
+    try expect(@intFromPtr(c.arena_alloc(&a, 30000, c.ARENA_OTHER)) == @intFromPtr(ptr));
+    try expect(c.arena_stats(&a).live == live);
+}
+
+test "reuse stack frames across pushes" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const tokenlist = tokenize_arena(&a, "{{a}}" ** 16);
+    try expect(tokenlist.len == 16 * 3);
+
+    // Templates only ever go three stacks deep here, and each depth gets one
+    // textbuffer, however often it is pushed.
+    const stats = c.arena_stats(&a);
+    try expect(stats.categories[c.ARENA_STACK].allocs == 1);
+    try expect(stats.categories[c.ARENA_TEXTBUFFER].allocs <= 3 * 2);
+}
+
+test "text tokens refer to the input instead of copying it" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "foo [[bar]] &amp; {{baz|qux}}";
+    const tokenlist = tokenize_arena(&a, txt);
+    try expect(tokenlist.len == 14);
+
+    const start = @intFromPtr(txt.ptr);
+    var i: usize = 0;
+    while (i < tokenlist.len) : (i += 1) {
+        const token = tokenlist.tokens[i];
+        if (token.type != c.Text)
+            continue;
+        const data = @intFromPtr(token.ctx.data);
+        try expect(data >= start and data + token.length <= start + txt.len);
+    }
+    try expectTextTokEql("amp", tokenlist.tokens[6]);
+}
+
+test "nested stacks are written into one shared token list" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "a {{b|[[c|''d'']]}} <!-- e -->";
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    const tokenlist = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+
+    // The outermost stack starts the shared list, and everything nested in
+    // it was written there in place.
+    try expect(tokenlist.tokens == tokenizer.tokens.tokens);
+    const expected = [_]c.Token{
+        .{ .type = c.Text, .ctx = .{ .data = cText("a ") } },
+        .{ .type = c.TemplateOpen },
+        .{ .type = c.Text, .ctx = .{ .data = cText("b") } },
+        .{ .type = c.TemplateParamSeparator },
+        .{ .type = c.WikilinkOpen },
+        .{ .type = c.Text, .ctx = .{ .data = cText("c") } },
+        .{ .type = c.WikilinkSeparator },
+        .{ .type = c.ItalicOpen },
+        .{ .type = c.Text, .ctx = .{ .data = cText("d") } },
+        .{ .type = c.ItalicClose },
+        .{ .type = c.WikilinkClose },
+        .{ .type = c.TemplateClose },
+        .{ .type = c.Text, .ctx = .{ .data = cText(" ") } },
+        .{ .type = c.CommentStart },
+        .{ .type = c.Text, .ctx = .{ .data = cText(" e ") } },
+        .{ .type = c.CommentEnd },
+    };
+    try expectTokensEql(&expected, tokenlist);
+}
+
+test "lay out tokens column by column" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const tokenlist = tokenize_arena(&a, "== a ==\n{{b|c}} [http://x y]");
+    const columns: *c.TokenColumns = c.TokenColumns_new(&a, &tokenlist);
+    try expect(columns.len == tokenlist.len);
+
+    var i: usize = 0;
+    var n: usize = 0;
+    while (i < tokenlist.len) : (i += 1) {
+        const token = tokenlist.tokens[i];
+        try expect(columns.types[i] == token.type);
+        if (token.type == c.TemplateOpen)
+            try expect(columns.ctx[i] == token.ctx.name.id and columns.ctx[i] != 0);
+        if (token.type == c.Text) {
+            try eqlStr(textFromTextTok(token), columns.texts[n][0..columns.lengths[n]]);
+            n += 1;
+        }
+    }
+    try expect(columns.texts_len == n);
+    try expect(c.TokenColumns_count(columns, c.Text) == n);
+    try expect(c.TokenColumns_count(columns, c.TemplateParamSeparator) == 1);
+
+    try expect(columns.types[0] == c.HeadingStart);
+    try expect(columns.ctx[0] == 2);
+    try expect(columns.types[columns.len - 5] == c.ExternalLinkOpen);
+    try expect(columns.ctx[columns.len - 5] == 1);
+}
+
+test "pack tokens into a compact stream" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const tokenlist = tokenize_arena(&a, "== a ==\n{{b|c}} [http://x y]");
+    const stream: *c.TokenStream = c.TokenStream_new(&a, &tokenlist);
+    try expect(stream.len == tokenlist.len);
+    try expect(stream.codes_size + stream.texts_size < tokenlist.len * @sizeOf(c.Token) / 4);
+
+    var reader: c.TokenStreamReader = undefined;
+    c.TokenStream_begin(stream, &reader);
+    var token: c.Token = undefined;
+    var i: usize = 0;
+    while (c.TokenStream_next(&reader, &token) != 0) : (i += 1) {
+        const expected = tokenlist.tokens[i];
+        try expect(token.type == expected.type);
+        try expect(token.offset == expected.offset);
+        if (token.type == c.Text)
+            try eqlStr(textFromTextTok(expected), textFromTextTok(token));
+    }
+    try expect(i == tokenlist.len);
+
+    const decoded = c.TokenStream_decode(&a, stream).*;
+    try expect(decoded.len == tokenlist.len);
+    try expect(decoded.tokens[0].type == c.HeadingStart);
+    try expect(decoded.tokens[0].ctx.heading.level == 2);
+    try expect(decoded.tokens[decoded.len - 5].ctx.external_link_open.brackets);
+}
+
+test "write pages to a token file and map them back" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const path = "test-pages.tok";
+    defer std.fs.cwd().deleteFile(path) catch {};
+    const pages = [_][]const u8{ "== a ==\n{{b|c}} [http://x y]", "''d'' [[e]]" };
+
+    var writer: c.TokenFileWriter = undefined;
+    try expect(c.TokenFileWriter_open(&writer, path) == 0);
+    for (pages) |txt| {
+        const tokenlist = tokenize_arena(&a, txt);
+        try expect(c.TokenFileWriter_add(&a, &writer, &tokenlist, txt.len) == 0);
+        // The writer keeps nothing in the arena between pages.
+        try expect(c.arena_reset(&a) == 0);
+    }
+    try expect(c.TokenFileWriter_close(&writer) == 0);
+
+    var file: c.TokenFile = undefined;
+    try expect(c.TokenFile_open(&file, path) == 0);
+    defer c.TokenFile_close(&file);
+    try expect(file.len == pages.len);
+
+    var page: c.TokenPage = undefined;
+    try expect(c.TokenFile_page(&file, 0, &page) == 0);
+    const expected = tokenize_arena(&a, pages[0]);
+    const tokenlist = c.TokenPage_decode(&a, &page).*;
+    try expect(tokenlist.len == expected.len);
+    for (0..tokenlist.len) |i| {
+        try expect(tokenlist.tokens[i].type == expected.tokens[i].type);
+        try expect(tokenlist.tokens[i].offset == expected.tokens[i].offset);
+        if (expected.tokens[i].type == c.Text)
+            try eqlStr(textFromTextTok(expected.tokens[i]), textFromTextTok(tokenlist.tokens[i]));
+    }
+    try expect(tokenlist.tokens[0].ctx.heading.level == 2);
+
+    // Tokens can also be read one at a time, straight from the mapping.
+    try expect(c.TokenFile_page(&file, 1, &page) == 0);
+    try expect(page.length == pages[1].len);
+    var token: c.Token = undefined;
+    c.TokenPage_get(&page, 1, &token);
+    try expectTextTokEql("d", token);
+    try expect(c.TokenFile_page(&file, 2, &page) != 0);
+}
+
+test "match the tokens that open and close each construct" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const tokenlist = tokenize_arena(&a, "{{a|[[b]]}} ''c''");
+    const match = c.TokenList_match(&a, &tokenlist);
+    try expect(match != null);
+
+    // TemplateOpen, Text, TemplateParamSeparator, WikilinkOpen, Text,
+    // WikilinkClose, TemplateClose, Text, ItalicOpen, Text, ItalicClose
+    const expected = [_]u32{ 6, 1, 2, 5, 4, 3, 0, 7, 10, 9, 8 };
+    try expect(tokenlist.len == expected.len);
+    for (expected, 0..) |m, i| try expect(match[i] == m);
+
+    // Skipping the template lands right after it.
+    try expect(tokenlist.tokens[match[0] + 1].type == c.Text);
+}
+
+test "map tokens back to where they are in the input" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "ab {{x|[[y]]}} ''c''";
+    const tokenlist = tokenize_arena(&a, txt);
+
+    // Text, TemplateOpen, Text, TemplateParamSeparator, WikilinkOpen, Text,
+    // WikilinkClose, TemplateClose, Text, ItalicOpen, Text, ItalicClose
+    const offsets = [_]usize{ 0, 3, 5, 6, 7, 9, 10, 12, 14, 15, 17, 18 };
+    try expect(tokenlist.len == offsets.len);
+    for (offsets, 0..) |offset, i| try expect(tokenlist.tokens[i].offset == offset);
+
+    const map = c.SourceMap_new(&a, &tokenlist, txt.len);
+    try expect(map != null);
+    // The template runs to the end of its closing braces.
+    try expect(map.*.starts[1] == 3 and map.*.ends[1] == 14);
+    try expect(map.*.starts[7] == 12 and map.*.ends[7] == 14);
+    // The wikilink's title is the innermost token at its offset.
+    try expect(c.SourceMap_find(map, 9) == 5);
+    try expect(c.SourceMap_find(map, 13) == 7);
+    try expect(c.SourceMap_find(map, txt.len - 1) == 11);
+}
+
+test "intern template names and parameter keys" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+
+    // A shared table lives in an arena of its own, which reset leaves alone.
+    var b: Arena = undefined;
+    try expect(c.arena_init(&b) == 0);
+    defer c.arena_clear(&b);
+    var base: c.StringTable = undefined;
+    c.StringTable_init(&base, null);
+    try expect(c.StringTable_add(&b, &base, "y", 1) == 1);
+
+    const txt = "{{x|key=1}} {{ x |key=2}}{{y}}";
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    tokenizer.names.base = &base;
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    const tokenlist = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+
+    // TemplateOpen, Text, TemplateParamSeparator, Text, TemplateParamEquals, ...
+    const x = tokenlist.tokens[0].ctx.name.id;
+    try expect(x > 1);
+    try expect(tokenlist.tokens[8].ctx.name.id == x);
+    const key = tokenlist.tokens[4].ctx.name.id;
+    try expect(key != 0 and key != x);
+    try expect(tokenlist.tokens[12].ctx.name.id == key);
+    try expect(tokenlist.tokens[15].ctx.name.id == 1);
+
+    const name = c.StringTable_get(&tokenizer.names, x);
+    try eqlStr("x", name.*.text[0..name.*.length]);
+}
+
+test "find interned strings when the table cannot grow" {
+    var buf: [1024]u8 = undefined;
+    var a: Arena = undefined;
+    try expect(c.arena_init_buffer(&a, &buf, buf.len) == 0);
+    defer c.arena_clear(&a);
+    var table: c.StringTable = undefined;
+    c.StringTable_init(&table, null);
+
+    const names = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    var n: u32 = 0;
+    while (n < names.len and c.StringTable_add(&a, &table, names[n..].ptr, 1) != 0) : (n += 1) {}
+    try expect(n > 0 and n < names.len);
+
+    // Strings already there are found without making room for another.
+    var i: u32 = 0;
+    while (i < n) : (i += 1) {
+        try expect(c.StringTable_add(&a, &table, names[i..].ptr, 1) == i + 1);
+    }
+}
+
+test "parse into a caller-provided buffer" {
+    var buf: [64 * 1024]u8 = undefined;
+    var a: Arena = undefined;
+    try expect(c.arena_init_buffer(&a, &buf, buf.len) == 0);
+    defer c.arena_clear(&a);
+
+    const tokenlist = tokenize_arena(&a, "''text''");
+
+    try expect(a.out_of_space == 0);
+    const expected = [_]c.Token{
+        .{ .type = c.ItalicOpen },
+        .{ .type = c.Text, .ctx = .{ .data = cText("text") } },
+        .{ .type = c.ItalicClose },
+    };
+    try expectTokensEql(&expected, tokenlist);
+}
+
+test "running out of a caller-provided buffer" {
+    var buf: [512]u8 = undefined;
+    var a: Arena = undefined;
+    try expect(c.arena_init_buffer(&a, &buf, buf.len) == 0);
+    defer c.arena_clear(&a);
+
+    const txt = "{{foo|bar=[[baz]]}} ''text''";
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+
+    try expect(c.Tokenizer_parse(&a, &tokenizer, 0, 1) == null);
+    try expect(a.out_of_space != 0);
+
+    // Resetting clears the flag, so the arena can be tried again.
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    try expect(a.out_of_space == 0);
+}
+
+test "fall back to plain text when the arena limit is reached" {
+    var a: Arena = undefined;
+    try expect(c.arena_init(&a) == 0);
+    defer c.arena_clear(&a);
+    a.limit = 128 * 1024;
+
+    const txt = "''foo'' " ++ "{{a|[[b|" ** 2000;
+    var tokenizer = std.mem.zeroes(c.Tokenizer);
+    try expect(c.Tokenizer_reset(&a, &tokenizer, txt.ptr, txt.len) == 0);
+    const tokenlist = @as(*c.TokenList, @ptrCast(c.Tokenizer_parse(&a, &tokenizer, 0, 1))).*;
+
+    try expect(tokenizer.degraded != 0);
+    const expected = [_]c.Token{
+        .{ .type = c.ItalicOpen },
+        .{ .type = c.Text, .ctx = .{ .data = cText("foo") } },
+        .{ .type = c.ItalicClose },
+        .{ .type = c.Text, .ctx = .{ .data = cText(" " ++ "{{a|[[b|" ** 2000) } },
+    };
+    try expectTokensEql(&expected, tokenlist);
+}
+
 // *************
 // HTML Entities
 // *************
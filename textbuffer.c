@@ -27,18 +27,46 @@ SOFTWARE.
 #define INITIAL_CAPACITY 32
 #define RESIZE_FACTOR    2
 
+typedef void *(*arena_alloc_fn)(memory_arena_t *, size_t, arena_category_t);
+
+static Textbuffer *
+Textbuffer_create(memory_arena_t *a, arena_alloc_fn alloc, size_t capacity)
+{
+    if (capacity < INITIAL_CAPACITY)
+        capacity = INITIAL_CAPACITY;
+    Textbuffer *self = alloc(a, sizeof(Textbuffer), ARENA_TEXTBUFFER);
+    if (!self)
+        return NULL;
+    self->data = alloc(a, capacity, ARENA_TEXTBUFFER);
+    if (!self->data) {
+        arena_free(a, self);
+        return NULL;
+    }
+    self->length = 0;
+    self->capacity = capacity;
+    self->span = NULL;
+
+    return self;
+}
+
 /*
     Create a new textbuffer object.
 */
 Textbuffer *
 Textbuffer_new(memory_arena_t *a, TokenizerInput *text)
 {
-    Textbuffer *self = arena_alloc(a, sizeof(Textbuffer));
-    self->data = arena_alloc(a, INITIAL_CAPACITY);
-    self->length = 0;
-    self->capacity = INITIAL_CAPACITY;
+    return Textbuffer_create(a, arena_alloc, 0);
+}
 
-    return self;
+/*
+    Create a textbuffer that survives arena_release_to(), for reuse across
+    routes, with room for at least the given number of bytes. Its storage
+    stays pinned as it grows.
+*/
+Textbuffer *
+Textbuffer_new_pinned(memory_arena_t *a, size_t capacity)
+{
+    return Textbuffer_create(a, arena_alloc_pinned, capacity);
 }
 
 /*
@@ -58,6 +86,32 @@ int
 Textbuffer_reset(Textbuffer *self)
 {
     self->length = 0;
+    self->span = NULL;
+    return 0;
+}
+
+/*
+    Make room for at least size bytes in data, and copy the span there if
+    the textbuffer has one.
+*/
+static int
+Textbuffer_reserve(memory_arena_t *a, Textbuffer *self, size_t size)
+{
+    if (size > self->capacity) {
+        size_t capacity = self->capacity;
+        while (capacity < size)
+            capacity *= RESIZE_FACTOR;
+        char *data = arena_reallocarray(a, self->data, capacity, 1);
+        if (data == NULL)
+            return 1;
+        self->data = data;
+        self->capacity = capacity;
+    }
+    if (self->span) {
+        memcpy(self->data, self->span, self->length);
+        self->span = NULL;
+    }
+
     return 0;
 }
 
@@ -67,13 +121,9 @@ Textbuffer_reset(Textbuffer *self)
 int
 Textbuffer_write(memory_arena_t *a, Textbuffer *self, char c)
 {
-    if (self->length >= self->capacity) {
-        self->data =
-            arena_reallocarray(a, self->data, self->capacity * RESIZE_FACTOR, 1);
-        if (self->data == NULL)
-            return 1;
-        self->capacity = self->capacity * RESIZE_FACTOR;
-    }
+    if ((self->length >= self->capacity || self->span) &&
+        Textbuffer_reserve(a, self, self->length + 1))
+        return 1;
 
     self->data[self->length] = c;
     self->length++;
@@ -81,6 +131,40 @@ Textbuffer_write(memory_arena_t *a, Textbuffer *self, char c)
     return 0;
 }
 
+/*
+    Write length bytes of text that stays valid for as long as the tokens do,
+    such as a run of the input. If they continue the span, or the textbuffer
+    is empty, the textbuffer refers to them instead of copying them.
+*/
+int
+Textbuffer_write_span(
+    memory_arena_t *a, Textbuffer *self, const char *text, size_t length)
+{
+    if (self->length == 0) {
+        self->span = text;
+    } else if (!self->span || self->span + self->length != text) {
+        return Textbuffer_append(a, self, text, length);
+    }
+    self->length += length;
+
+    return 0;
+}
+
+/*
+    Copy length bytes of text onto the end of the given textbuffer.
+*/
+int
+Textbuffer_append(memory_arena_t *a, Textbuffer *self, const char *text, size_t length)
+{
+    if (Textbuffer_reserve(a, self, self->length + length))
+        return 1;
+
+    memcpy(self->data + self->length, text, length);
+    self->length += length;
+
+    return 0;
+}
+
 /*
     Read a Unicode codepoint from the given index of the given textbuffer.
 
@@ -89,7 +173,7 @@ Textbuffer_write(memory_arena_t *a, Textbuffer *self, char c)
 char
 Textbuffer_read(Textbuffer *self, size_t index)
 {
-    return self->data[index];
+    return self->span ? self->span[index] : self->data[index];
 }
 
 /*
@@ -98,40 +182,35 @@ Textbuffer_read(Textbuffer *self, size_t index)
 int
 Textbuffer_concat(memory_arena_t *a, Textbuffer *self, Textbuffer *other)
 {
-    size_t newlen = self->length + other->length;
-
-    if (newlen > self->capacity) {
-        self->data =
-            arena_reallocarray(a, self->data, self->capacity * RESIZE_FACTOR, 1);
-        if (self->data == NULL)
-            return 1;
-        self->capacity = self->capacity * RESIZE_FACTOR;
-    }
-
-    memcpy(self->data + self->length, other->data, other->length);
-    self->length = newlen;
-
-    return 0;
+    if (other->span)
+        return Textbuffer_write_span(a, self, other->span, other->length);
+    return Textbuffer_append(a, self, other->data, other->length);
 }
 
 /*
-    Null terminated char buffer owned by the caller
+    Return the contents as text that outlives the textbuffer: the span itself,
+    or a copy owned by the caller. It is not NUL terminated.
 */
-char *
+const char *
 Textbuffer_export(memory_arena_t *a, Textbuffer *self)
 {
-    char *data = arena_alloc(a, self->length + 1);
+    if (self->span)
+        return self->span;
+
+    char *data = arena_alloc(a, self->length, ARENA_TEXT);
+    if (!data)
+        return NULL;
     memcpy(data, self->data, self->length);
-    data[self->length] = 0;
     return data;
 }
 
 /*
-    Reverse the contents of the given textbuffer.
+    Reverse the contents of the given textbuffer, which must not have a span.
 */
 void
 Textbuffer_reverse(Textbuffer *self)
 {
+    assert(!self->span);
     size_t end = self->length - 1;
 
     for (size_t i = 0; i < self->length / 2; i++) {
@@ -28,10 +28,13 @@ SOFTWARE.
 /* Functions */
 
 Textbuffer* Textbuffer_new(memory_arena_t*, TokenizerInput*);
+Textbuffer* Textbuffer_new_pinned(memory_arena_t*, size_t);
 void Textbuffer_dealloc(memory_arena_t*, Textbuffer*);
 int Textbuffer_reset(Textbuffer*);
 int Textbuffer_write(memory_arena_t*, Textbuffer*, char);
+int Textbuffer_write_span(memory_arena_t*, Textbuffer*, const char*, size_t);
+int Textbuffer_append(memory_arena_t*, Textbuffer*, const char*, size_t);
 char Textbuffer_read(Textbuffer*, size_t);
-char* Textbuffer_export(memory_arena_t*, Textbuffer*);
+const char* Textbuffer_export(memory_arena_t*, Textbuffer*);
 int Textbuffer_concat(memory_arena_t*, Textbuffer*, Textbuffer*);
 void Textbuffer_reverse(Textbuffer*);
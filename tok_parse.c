@@ -21,6 +21,7 @@ SOFTWARE.
 */
 
 #include "tok_parse.h"
+#include "charclass.h"
 #include "common.h"
 #include "contexts.h"
 #include "memoryarena.h"
@@ -28,11 +29,9 @@ SOFTWARE.
 #include "textbuffer.h"
 #include "tok_support.h"
 #include "tokens.h"
-
-#define DIGITS          "0123456789"
-#define HEXDIGITS       "0123456789abcdefABCDEF"
-#define ALPHANUM        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
-#define URISCHEME       "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+.-"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define MAX_BRACES      255
 #define MAX_ENTITY_SIZE 8
@@ -54,17 +53,46 @@ static int Tokenizer_parse_tag(memory_arena_t *, Tokenizer *);
 /*
     Determine whether the given code point is a marker.
 */
-static int
+static inline int
 is_marker(char this)
 {
-    int i;
+    return char_is(this, CC_MARKER);
+}
 
-    for (i = 0; i < NUM_MARKERS; i++) {
-        if (MARKERS[i] == this) {
-            return 1;
-        }
+/*
+    Return the index of the first marker in the given text, or its length if
+    there is none. This is how plain text is skipped over, so where SSE2 is
+    available it looks at 16 bytes at a time.
+*/
+static size_t
+find_marker(const char *text, size_t length)
+{
+    size_t i = 0;
+
+    // Runs in markup are often only a few bytes long, which is quicker to
+    // find one byte at a time.
+    while (i < length && i < 4) {
+        if (is_marker(text[i]))
+            return i;
+        i++;
     }
-    return 0;
+#if defined(__SSE2__)
+    while (i + 16 <= length) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (text + i));
+        __m128i found = _mm_setzero_si128();
+        for (int j = 0; j < NUM_MARKERS; j++) {
+            __m128i marker = _mm_set1_epi8(MARKERS[j]);
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, marker));
+        }
+        int mask = _mm_movemask_epi8(found);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < length && !is_marker(text[i]))
+        i++;
+    return i;
 }
 
 /*
@@ -84,38 +112,70 @@ heading_level_from_context(uint64_t n)
 
 /*
     Sanitize the name of a tag so it can be compared with others for equality.
-    The token argument must have `type=Text`
+    The token argument must have `type=Text`. Its text may be part of the
+    input, so it is replaced with a sanitized copy.
 */
 static int
-strip_tag_name(Token *token, int take_attr)
+strip_tag_name(memory_arena_t *a, Token *token, int take_attr)
 {
     // PyObject *text, *rstripped, *lowered;
 
     assert(token->type == Text);
 
     // rstrip text
-    size_t len = strlen(token->ctx.data);
-    char *text = token->ctx.data;
-    int text_end = len - 1;
-
-    while (text_end > 0 && isspace(text[text_end]))
-        text_end--;
+    const char *text = token->ctx.data;
+    size_t len = token->length;
 
-    text[text_end + 1] = 0;
+    while (len > 1 && char_is(text[len - 1], CC_SPACE))
+        len--;
 
-    for (int i = 0; i <= text_end; i++) {
-        if (isupper(text[i]))
-            text[i] += 32;
+    char *lowered = arena_alloc(a, len, ARENA_TEXT);
+    if (!lowered)
+        return 1;
+    for (size_t i = 0; i < len; i++) {
+        lowered[i] = char_lower(text[i]);
     }
+    token->ctx.data = lowered;
+    token->length = len;
 
     return 0;
 }
 
+/*
+    Intern the name of a tag, which is matched without regard to case. The
+    token argument must have `type=Text`.
+*/
+static uint32_t
+Tokenizer_intern_tag_name(memory_arena_t *a, Tokenizer *self, const Token *token)
+{
+    const char *text = token->ctx.data;
+    size_t len = token->length;
+    size_t i = 0;
+
+    while (i < len && !char_is(text[i], CC_UPPER))
+        i++;
+    if (i == len)
+        return Tokenizer_intern(a, self, text, len);
+
+    int out_of_space = a->out_of_space;
+    char *lowered = arena_alloc(a, len, ARENA_TEXT);
+    if (!lowered) {
+        a->out_of_space = out_of_space;
+        return 0;
+    }
+    for (i = 0; i < len; i++)
+        lowered[i] = char_lower(text[i]);
+    uint32_t id = Tokenizer_intern(a, self, lowered, len);
+    arena_free(a, lowered);
+    return id;
+}
+
 /*
     Parse a template at the head of the wikicode string.
 */
 static int
-Tokenizer_parse_template(memory_arena_t *a, Tokenizer *self, int has_content)
+Tokenizer_parse_template(
+    memory_arena_t *a, Tokenizer *self, int has_content, size_t offset)
 {
     size_t reset = self->head;
     uint64_t context = LC_TEMPLATE_NAME;
@@ -133,18 +193,21 @@ Tokenizer_parse_template(memory_arena_t *a, Tokenizer *self, int has_content)
         return 1;
     }
 
-    Token open;
-    open.type = TemplateOpen;
-    open.ctx.data = NULL;
+    TOKEN(open, TemplateOpen)
+    open.offset = offset;
+    if (template->len && template->tokens[0].type == Text &&
+        (template->len == 1 || template->tokens[1].type == TemplateParamSeparator)) {
+        Token *name = &template->tokens[0];
+        open.ctx.name.id = Tokenizer_intern(a, self, name->ctx.data, name->length);
+    }
     if (Tokenizer_emit_first(a, self, &open)) {
         return 1;
     }
     if (Tokenizer_emit_all(a, self, template)) {
         return 1;
     }
-    Token close;
-    close.type = TemplateClose;
-    close.ctx.data = NULL;
+    TOKEN(close, TemplateClose)
+    close.offset = self->head - 1;
     if (Tokenizer_emit(a, self, &close)) {
         return 1;
     }
@@ -155,7 +218,7 @@ Tokenizer_parse_template(memory_arena_t *a, Tokenizer *self, int has_content)
     Parse an argument at the head of the wikicode string.
 */
 static int
-Tokenizer_parse_argument(memory_arena_t *a, Tokenizer *self)
+Tokenizer_parse_argument(memory_arena_t *a, Tokenizer *self, size_t offset)
 {
     size_t reset = self->head;
 
@@ -169,6 +232,7 @@ Tokenizer_parse_argument(memory_arena_t *a, Tokenizer *self)
     }
 
     TOKEN(open, ArgumentOpen)
+    open.offset = offset;
     if (Tokenizer_emit_first(a, self, &open)) {
         return 1;
     }
@@ -176,6 +240,7 @@ Tokenizer_parse_argument(memory_arena_t *a, Tokenizer *self)
         return 1;
     }
     TOKEN(close, ArgumentClose)
+    close.offset = self->head - 2;
     if (Tokenizer_emit(a, self, &close)) {
         return 1;
     }
@@ -188,9 +253,13 @@ Tokenizer_parse_argument(memory_arena_t *a, Tokenizer *self)
 static int
 Tokenizer_parse_template_or_argument(memory_arena_t *a, Tokenizer *self)
 {
-    unsigned int braces = 2, i;
+    unsigned int braces = 2;
     int has_content = 0;
-    TokenList *tokenlist = self->topstack->tokenlist;
+    TokenList *tokenlist;
+    // The braces left over are the first ones, and each construct opens with
+    // the last of them.
+    size_t start = self->head;
+    const char *text = self->text.data + start;
 
     self->head += 2;
     while (Tokenizer_read(self, 0) == '{' && braces < MAX_BRACES) {
@@ -202,40 +271,35 @@ Tokenizer_parse_template_or_argument(memory_arena_t *a, Tokenizer *self)
     }
     while (braces) {
         if (braces == 1) {
-            if (Tokenizer_emit_text_then_stack(a, self, "{")) {
+            if (Tokenizer_emit_text_then_stack(a, self, text, 1)) {
                 return 1;
             }
             return 0;
         }
         if (braces == 2) {
-            if (Tokenizer_parse_template(a, self, has_content)) {
+            if (Tokenizer_parse_template(a, self, has_content, start)) {
                 return 1;
             }
             if (BAD_ROUTE) {
                 RESET_ROUTE();
-                if (Tokenizer_emit_text_then_stack(a, self, "{{")) {
+                if (Tokenizer_emit_text_then_stack(a, self, text, 2)) {
                     return 1;
                 }
                 return 0;
             }
             break;
         }
-        if (Tokenizer_parse_argument(a, self)) {
+        if (Tokenizer_parse_argument(a, self, start + braces - 3)) {
             return 1;
         }
         if (BAD_ROUTE) {
             RESET_ROUTE();
-            if (Tokenizer_parse_template(a, self, has_content)) {
+            if (Tokenizer_parse_template(a, self, has_content, start + braces - 2)) {
                 return 1;
             }
             if (BAD_ROUTE) {
-                char text[MAX_BRACES + 1];
                 RESET_ROUTE();
-                for (i = 0; i < braces; i++) {
-                    text[i] = '{';
-                }
-                text[braces] = '\0';
-                if (Tokenizer_emit_text_then_stack(a, self, text)) {
+                if (Tokenizer_emit_text_then_stack(a, self, text, braces)) {
                     return -1;
                 }
                 return 0;
@@ -308,11 +372,16 @@ Tokenizer_handle_template_param_value(memory_arena_t *a, Tokenizer *self)
     if (!stack) {
         return 1;
     }
+    uint32_t key = 0;
+    Token *name = &stack->tokens[0];
+    if (stack->len == 1 && name->type == Text)
+        key = Tokenizer_intern(a, self, name->ctx.data, name->length);
     if (Tokenizer_emit_all(a, self, stack))
         return 1;
     self->topstack->context ^= LC_TEMPLATE_PARAM_KEY;
     self->topstack->context |= LC_TEMPLATE_PARAM_VALUE;
     TOKEN(tpeql, TemplateParamEquals)
+    tpeql.ctx.name.id = key;
     if (Tokenizer_emit(a, self, &tpeql)) {
         return 1;
     }
@@ -388,18 +457,20 @@ Tokenizer_parse_wikilink(memory_arena_t *a, Tokenizer *self)
         if (BAD_ROUTE) {
             RESET_ROUTE();
             self->head = reset;
-            if (Tokenizer_emit_text(a, self, "[["))
+            if (Tokenizer_emit_run(a, self, self->text.data + reset - 1, 2))
                 return 1;
             return 0;
         }
         if (!wikilink)
             return 1;
         TOKEN(wikiopen, WikilinkOpen)
+        wikiopen.offset = reset - 1;
         if (Tokenizer_emit(a, self, &wikiopen))
             return 1;
         if (Tokenizer_emit_all(a, self, wikilink))
             return 1;
         TOKEN(wikiclose, WikilinkClose)
+        wikiclose.offset = self->head - 1;
         if (Tokenizer_emit(a, self, &wikiclose))
             return 1;
         return 0;
@@ -411,11 +482,11 @@ Tokenizer_parse_wikilink(memory_arena_t *a, Tokenizer *self)
         // In this exceptional case, an external link that looks like a
         // wikilink inside of an external link is parsed as text:
         self->head = reset;
-        if (Tokenizer_emit_text(a, self, "[["))
+        if (Tokenizer_emit_run(a, self, self->text.data + reset - 1, 2))
             return 1;
         return 0;
     }
-    if (Tokenizer_emit_text(a, self, "["))
+    if (Tokenizer_emit_run(a, self, self->text.data + reset - 1, 1))
         return 1;
 
     TOKEN_CTX(el_brackets, ExternalLinkOpen)
@@ -464,13 +535,11 @@ Tokenizer_handle_wikilink_end(memory_arena_t *a, Tokenizer *self)
 static int
 Tokenizer_parse_bracketed_uri_scheme(memory_arena_t *a, Tokenizer *self)
 {
-    static const char *valid = URISCHEME;
-
     if (Tokenizer_check_route(self, LC_EXT_LINK_URI) < 0) {
         return 0;
     }
 
-    if (Tokenizer_push(a, self, LC_EXT_LINK_URI)) {
+    if (Tokenizer_push_reserving(a, self, LC_EXT_LINK_URI, 1)) {
         return 1;
     }
 
@@ -485,17 +554,7 @@ Tokenizer_parse_bracketed_uri_scheme(memory_arena_t *a, Tokenizer *self)
             return 1;
         }
         char this;
-        while ((this = Tokenizer_read(self, 0))) {
-            size_t i = 0;
-            while (true) {
-                if (!valid[i]) {
-                    goto end_of_loop;
-                }
-                if (this == valid[i]) {
-                    break;
-                }
-                i++;
-            }
+        while (char_is(this = Tokenizer_read(self, 0), CC_SCHEME)) {
             Textbuffer_write(a, buffer, this);
             if (Tokenizer_emit_char(a, self, this)) {
                 Textbuffer_dealloc(a, buffer);
@@ -503,7 +562,6 @@ Tokenizer_parse_bracketed_uri_scheme(memory_arena_t *a, Tokenizer *self)
             }
             self->head++;
         }
-    end_of_loop:
         if (this != ':') {
             Textbuffer_dealloc(a, buffer);
             Tokenizer_fail_route(a, self);
@@ -523,8 +581,8 @@ Tokenizer_parse_bracketed_uri_scheme(memory_arena_t *a, Tokenizer *self)
             self->head += 2;
         }
         if (!is_scheme(buffer->data, buffer->length, slashes)) {
-            Tokenizer_fail_route(a, self);
             Textbuffer_dealloc(a, buffer);
+            Tokenizer_fail_route(a, self);
             return 0;
         }
     }
@@ -538,8 +596,6 @@ Tokenizer_parse_bracketed_uri_scheme(memory_arena_t *a, Tokenizer *self)
 static int
 Tokenizer_parse_free_uri_scheme(memory_arena_t *a, Tokenizer *self)
 {
-    // static const char *valid = URISCHEME;
-#define IS_VALID(ch) (isalnum(ch) || ch == '+' || ch == '-' || ch == ".")
     Textbuffer *scheme = Textbuffer_new(a, &self->text);
     if (!scheme) {
         return 1;
@@ -550,7 +606,7 @@ Tokenizer_parse_free_uri_scheme(memory_arena_t *a, Tokenizer *self)
     for (int i = self->topstack->textbuffer->length - 1; i >= 0; i--) {
         char ch = Textbuffer_read(self->topstack->textbuffer, i);
         // Stop at the first non-word character (equivalent to \W in regex)
-        if (!isalnum(ch) && ch != '_') {
+        if (!char_is(ch, CC_ALNUM) && ch != '_') {
             break;
         }
         Textbuffer_write(a, scheme, ch);
@@ -572,14 +628,17 @@ Tokenizer_parse_free_uri_scheme(memory_arena_t *a, Tokenizer *self)
         return 1;
     }
 
-    if (Tokenizer_push(a, self, new_context)) {
+    if (Tokenizer_push_reserving(a, self, new_context, 1)) {
         Textbuffer_dealloc(a, scheme);
         return 1;
     }
 
+    // The scheme ends at the colon, which is right before the head.
+    size_t offset = self->head - 1 - scheme->length;
     if (Tokenizer_emit_textbuffer(a, self, scheme)) {
         return 1;
     }
+    self->topstack->text_offset = offset;
 
     if (Tokenizer_emit_char(a, self, ':')) {
         return 1;
@@ -605,6 +664,8 @@ Tokenizer_handle_free_link_text(
 #define PUSH_TAIL_BUFFER(tail, error)                                                  \
     do {                                                                               \
         if (tail && tail->length > 0) {                                                \
+            if (self->topstack->textbuffer->length == 0)                               \
+                self->topstack->text_offset = self->head - tail->length;               \
             if (Textbuffer_concat(a, self->topstack->textbuffer, tail)) {              \
                 return error;                                                          \
             }                                                                          \
@@ -637,9 +698,8 @@ Tokenizer_is_uri_end(Tokenizer *self, char this, char next)
     char after = Tokenizer_read(self, 2);
     uint64_t ctx = self->topstack->context;
 
-    return (!this || this == '\n' || this == '[' || this == ']' || this == '<' ||
-            this == '>' || this == '"' || this == ' ' ||
-            (this == '\'' && next == '\'') || (this == '|' && ctx & LC_TEMPLATE) ||
+    return (char_is(this, CC_URI_END) || (this == '\'' && next == '\'') ||
+            (this == '|' && ctx & LC_TEMPLATE) ||
             (this == '=' && ctx & (LC_TEMPLATE_PARAM_KEY | LC_HEADING)) ||
             (this == '}' && next == '}' &&
              (ctx & LC_TEMPLATE || (after == '}' && ctx & LC_ARGUMENT))));
@@ -735,8 +795,7 @@ Tokenizer_really_parse_external_link(memory_arena_t *a,
 static int
 Tokenizer_remove_uri_scheme_from_textbuffer(Tokenizer *self, TokenList *link)
 {
-    self->topstack->textbuffer->length = 0;
-    return 0;
+    return Textbuffer_reset(self->topstack->textbuffer);
 }
 
 /*
@@ -757,6 +816,10 @@ Tokenizer_parse_external_link(memory_arena_t *a, Tokenizer *self, bool brackets)
     if (self->topstack->context & AGG_NO_EXT_LINKS || !(Tokenizer_CAN_RECURSE(self))) {
         NOT_A_LINK;
     }
+    // 'extra' may grow while the link's route is speculated, so roll back to
+    // before it was created rather than freeing it if the route fails.
+    int depth = self->depth;
+    arena_mark_t mark = arena_mark(a);
     extra = Textbuffer_new(a, &self->text);
     if (!extra) {
         return 1;
@@ -766,7 +829,8 @@ Tokenizer_parse_external_link(memory_arena_t *a, Tokenizer *self, bool brackets)
     if (BAD_ROUTE) {
         RESET_ROUTE();
         self->head = reset;
-        Textbuffer_dealloc(a, extra);
+        Tokenizer_drop_stacks(self, depth);
+        arena_release_to(a, mark);
         NOT_A_LINK;
     }
     if (!link) {
@@ -782,6 +846,8 @@ Tokenizer_parse_external_link(memory_arena_t *a, Tokenizer *self, bool brackets)
 
     TOKEN_CTX(el_open, ExternalLinkOpen)
     el_open.ctx.external_link_open.brackets = brackets;
+    // A free link starts with the scheme that was taken back from the text.
+    el_open.offset = brackets || !link->len ? reset : link->tokens[0].offset;
     if (Tokenizer_emit(a, self, &el_open)) {
         Textbuffer_dealloc(a, extra);
         return 1;
@@ -792,14 +858,21 @@ Tokenizer_parse_external_link(memory_arena_t *a, Tokenizer *self, bool brackets)
         return 1;
     }
 
+    // A free link ends with the head on its last character, or on the space
+    // after it. Punctuation and the space were held back as extra text.
     TOKEN(el_close, ExternalLinkClose)
+    if (!brackets)
+        el_close.offset = self->head + 1 - extra->length;
     if (Tokenizer_emit(a, self, &el_close)) {
         Textbuffer_dealloc(a, extra);
         return 1;
     }
 
     if (extra->length > 0) {
-        return Tokenizer_emit_textbuffer(a, self, extra);
+        if (Tokenizer_emit_textbuffer(a, self, extra))
+            return 1;
+        self->topstack->text_offset = el_close.offset;
+        return 0;
     }
 
     Textbuffer_dealloc(a, extra);
@@ -813,7 +886,7 @@ static int
 Tokenizer_parse_heading(memory_arena_t *a, Tokenizer *self)
 {
     size_t reset = self->head;
-    int best = 1, i, context, diff;
+    int best = 1, context, diff;
 
     self->global |= GL_HEADING;
     self->head += 1;
@@ -826,11 +899,8 @@ Tokenizer_parse_heading(memory_arena_t *a, Tokenizer *self)
     if (BAD_ROUTE) {
         RESET_ROUTE();
         self->head = reset + best - 1;
-        for (i = 0; i < best; i++) {
-            if (Tokenizer_emit_char(a, self, '=')) {
-                return 1;
-            }
-        }
+        if (Tokenizer_emit_run(a, self, self->text.data + reset, best))
+            return 1;
         self->global ^= GL_HEADING;
         return 0;
     }
@@ -844,11 +914,8 @@ Tokenizer_parse_heading(memory_arena_t *a, Tokenizer *self)
     if (BAD_ROUTE) {
         RESET_ROUTE();
         self->head = reset + best - 1;
-        for (i = 0; i < best; i++) {
-            if (Tokenizer_emit_char(a, self, '=')) {
-                return 1;
-            }
-        }
+        if (Tokenizer_emit_run(a, self, self->text.data + reset, best))
+            return 1;
         self->global ^= GL_HEADING;
         return 0;
     }
@@ -861,22 +928,23 @@ Tokenizer_parse_heading(memory_arena_t *a, Tokenizer *self)
     }
     TOKEN_CTX(heading_open, HeadingStart)
     heading_open.ctx.heading.level = level;
+    heading_open.offset = reset;
     if (Tokenizer_emit(a, self, &heading_open)) {
         return 1;
     }
     if (level < best) {
+        // The signs past the heading's level are text.
         diff = best - level;
-        for (i = 0; i < diff; i++) {
-            if (Tokenizer_emit_char(a, self, '=')) {
-                return 1;
-            }
-        }
+        if (Tokenizer_emit_run(a, self, self->text.data + reset + level, diff))
+            return 1;
     }
     if (Tokenizer_emit_all(a, self, title)) {
         arena_free(a, title_level);
         return -1;
     }
+    // The head is on the last of the signs that close the heading.
     TOKEN(h_end, HeadingEnd)
+    h_end.offset = self->head + 1 - level;
     if (Tokenizer_emit(a, self, &h_end)) {
         return 1;
     }
@@ -891,7 +959,7 @@ static HeadingData *
 Tokenizer_handle_heading_end(memory_arena_t *a, Tokenizer *self)
 {
     size_t reset = self->head;
-    int best, i, current, level, diff;
+    int best, current, level, diff;
     HeadingData *after, *heading;
     TokenList *stack;
 
@@ -908,23 +976,18 @@ Tokenizer_handle_heading_end(memory_arena_t *a, Tokenizer *self)
         RESET_ROUTE();
         if (level < best) {
             diff = best - level;
-            for (i = 0; i < diff; i++) {
-                if (Tokenizer_emit_char(a, self, '=')) {
-                    return NULL;
-                }
-            }
+            if (Tokenizer_emit_run(a, self, self->text.data + reset, diff))
+                return NULL;
         }
         self->head = reset + best - 1;
     } else {
         if (!after) {
             return NULL;
         }
-        for (i = 0; i < best; i++) {
-            if (Tokenizer_emit_char(a, self, '=')) {
-                // Py_DECREF(after->title);
-                arena_free(a, after);
-                return NULL;
-            }
+        if (Tokenizer_emit_run(a, self, self->text.data + reset, best)) {
+            // Py_DECREF(after->title);
+            arena_free(a, after);
+            return NULL;
         }
         if (Tokenizer_emit_all(a, self, after->title)) {
             // Py_DECREF(after->title);
@@ -938,7 +1001,7 @@ Tokenizer_handle_heading_end(memory_arena_t *a, Tokenizer *self)
     if (!stack) {
         return NULL;
     }
-    heading = arena_alloc(a, sizeof(HeadingData));
+    heading = arena_alloc(a, sizeof(HeadingData), ARENA_OTHER);
     if (!heading)
         return NULL;
     heading->title = stack;
@@ -956,8 +1019,8 @@ Tokenizer_really_parse_entity(memory_arena_t *a, Tokenizer *self)
 
 #define FAIL_ROUTE_AND_EXIT()                                                          \
     do {                                                                               \
-        Tokenizer_fail_route(a, self);                                                 \
         arena_free(a, text);                                                           \
+        Tokenizer_fail_route(a, self);                                                 \
         return 0;                                                                      \
     } while (0)
 
@@ -994,19 +1057,21 @@ Tokenizer_really_parse_entity(memory_arena_t *a, Tokenizer *self)
     } else {
         numeric = hexadecimal = 0;
     }
-    const char *valid;
+    uint16_t valid;
     if (hexadecimal) {
-        valid = HEXDIGITS;
+        valid = CC_HEX;
     } else if (numeric) {
-        valid = DIGITS;
+        valid = CC_DIGIT;
     } else {
-        valid = ALPHANUM;
+        valid = CC_ALNUM;
     }
-    char *text = arena_calloc(a, MAX_ENTITY_SIZE, sizeof(char));
+    // The entity's text, leading zeroes included, is a run of the input. The
+    // copy is only kept to convert numeric entities.
+    size_t start = self->head;
+    char *text = arena_calloc(a, MAX_ENTITY_SIZE + 1, sizeof(char), ARENA_TEXT);
     if (!text)
         return 1;
     int i = 0;
-    int zeroes = 0;
     while (1) {
         this = Tokenizer_read(self, 0);
         if (this == ';') {
@@ -1016,7 +1081,6 @@ Tokenizer_really_parse_entity(memory_arena_t *a, Tokenizer *self)
             break;
         }
         if (i == 0 && numeric && this == '0') {
-            zeroes++;
             self->head++;
             continue;
         }
@@ -1026,15 +1090,8 @@ Tokenizer_really_parse_entity(memory_arena_t *a, Tokenizer *self)
         if (is_marker(this)) {
             FAIL_ROUTE_AND_EXIT();
         }
-        int j = 0;
-        while (1) {
-            if (!valid[j]) {
-                FAIL_ROUTE_AND_EXIT();
-            }
-            if (this == valid[j]) {
-                break;
-            }
-            j++;
+        if (!char_is(this, valid)) {
+            FAIL_ROUTE_AND_EXIT();
         }
         text[i] = (char) this;
         self->head++;
@@ -1051,21 +1108,11 @@ Tokenizer_really_parse_entity(memory_arena_t *a, Tokenizer *self)
     // TODO: Place all possible into a comptime hash table;
     // For now, char entities are assumed to be valid.
 
-    if (zeroes) {
-        char *buffer = arena_calloc(a, strlen(text) + zeroes + 1, sizeof(char));
-        if (!buffer) {
-            arena_free(a, text);
-            return 1;
-        }
-        for (i = 0; i < zeroes; i++) {
-            strcat(buffer, "0");
-        }
-        strcat(buffer, text);
-        arena_free(a, text);
-        text = buffer;
-    }
+    arena_free(a, text);
     TOKEN_CTX(txt_tok, Text)
-    txt_tok.ctx.data = text;
+    txt_tok.ctx.data = (char *) self->text.data + start;
+    txt_tok.length = self->head - start;
+    txt_tok.offset = start;
     if (Tokenizer_emit(a, self, &txt_tok))
         return 1;
     TOKEN(hte_end, HTMLEntityEnd);
@@ -1087,7 +1134,7 @@ Tokenizer_parse_entity(memory_arena_t *a, Tokenizer *self)
         goto on_bad_route;
     }
     if (Tokenizer_push(a, self, LC_HTML_ENTITY)) {
-        assert(false);
+        return -1;
     }
     if (Tokenizer_really_parse_entity(a, self)) {
         // puts("TRACE: really_parse_entity failed");
@@ -1103,7 +1150,8 @@ Tokenizer_parse_entity(memory_arena_t *a, Tokenizer *self)
         return 0;
     }
     TokenList *tokenlist = Tokenizer_pop(a, self);
-    assert(tokenlist);
+    if (!tokenlist)
+        return -1;
     // printf("TRACE: head: %zu, TokenList.len: %zu\n", self->head,
     // tokenlist->len);
     if (Tokenizer_emit_all(a, self, tokenlist))
@@ -1121,7 +1169,7 @@ Tokenizer_parse_comment(memory_arena_t *a, Tokenizer *self)
     TokenList *comment;
 
     self->head += 4;
-    if (Tokenizer_push(a, self, 0)) {
+    if (Tokenizer_push_reserving(a, self, 0, 1)) {
         return 1;
     }
     while (1) {
@@ -1129,11 +1177,12 @@ Tokenizer_parse_comment(memory_arena_t *a, Tokenizer *self)
         if (!this) {
             comment = Tokenizer_pop(a, self);
             self->head = reset;
-            return Tokenizer_emit_text(a, self, "<!--");
+            return Tokenizer_emit_run(a, self, self->text.data + reset - 3, 4);
         }
         if (this == '-' && Tokenizer_read(self, 1) == this &&
             Tokenizer_read(self, 2) == '>') {
             TOKEN(c_start, CommentStart)
+            c_start.offset = reset - 3;
             if (Tokenizer_emit_first(a, self, &c_start)) {
                 return 1;
             }
@@ -1175,6 +1224,7 @@ Tokenizer_push_tag_buffer(memory_arena_t *a, Tokenizer *self, TagData *data)
     if (data->context & TAG_QUOTED) {
         TOKEN_CTX(tag_attr_q_token, TagAttrQuote);
         tag_attr_q_token.ctx.tag_attr_quote.quote = data->quoter;
+        tag_attr_q_token.offset = data->reset;
         if (Tokenizer_emit_first(a, self, &tag_attr_q_token))
             return 1;
 
@@ -1205,7 +1255,9 @@ Tokenizer_push_tag_buffer(memory_arena_t *a, Tokenizer *self, TagData *data)
     //     return -1;
     // }
 
+    // The attribute's stack was pushed where its name starts.
     TOKEN(tag_attr_start_tok, TagAttrStart);
+    tag_attr_start_tok.offset = self->topstack->ident.head;
     if (Tokenizer_emit_first(a, self, &tag_attr_start_tok))
         return 1;
 
@@ -1282,17 +1334,17 @@ Tokenizer_handle_tag_data(memory_arena_t *a, Tokenizer *self, TagData *data, cha
 {
     if (data->context & TAG_NAME) {
         int first_time = !(data->context & TAG_NOTE_SPACE);
-        if (is_marker(chunk) || (isspace(chunk) && first_time)) {
+        if (is_marker(chunk) || (char_is(chunk, CC_SPACE) && first_time)) {
             // Tags must start with text, not spaces
             Tokenizer_fail_route(a, self);
             return 0;
         } else if (first_time) {
             data->context |= TAG_NOTE_SPACE;
-        } else if (isspace(chunk)) {
+        } else if (char_is(chunk, CC_SPACE)) {
             data->context = TAG_ATTR_READY;
             return Tokenizer_handle_tag_space(a, self, data, chunk);
         }
-    } else if (isspace(chunk)) {
+    } else if (char_is(chunk, CC_SPACE)) {
         return Tokenizer_handle_tag_space(a, self, data, chunk);
     } else if (data->context & TAG_NOTE_SPACE) {
         if (data->context & TAG_QUOTED) {
@@ -1306,7 +1358,7 @@ Tokenizer_handle_tag_data(memory_arena_t *a, Tokenizer *self, TagData *data, cha
         return 0;
     } else if (data->context & TAG_ATTR_READY) {
         data->context = TAG_ATTR_NAME;
-        if (Tokenizer_push(a, self, LC_TAG_ATTR)) {
+        if (Tokenizer_push_reserving(a, self, LC_TAG_ATTR, 1)) {
             return -1;
         }
     } else if (data->context & TAG_ATTR_NAME) {
@@ -1323,7 +1375,7 @@ Tokenizer_handle_tag_data(memory_arena_t *a, Tokenizer *self, TagData *data, cha
                 return -1;
             }
             data->context = TAG_ATTR_NAME;
-            if (Tokenizer_push(a, self, LC_TAG_ATTR)) {
+            if (Tokenizer_push_reserving(a, self, LC_TAG_ATTR, 1)) {
                 return -1;
             }
         }
@@ -1340,7 +1392,8 @@ Tokenizer_handle_tag_data(memory_arena_t *a, Tokenizer *self, TagData *data, cha
                     RESET_ROUTE();
                     data->context = TAG_ATTR_VALUE;
                     self->head--;
-                } else if (Tokenizer_push(a, self, self->topstack->context)) {
+                } else if (Tokenizer_push_reserving(
+                               a, self, self->topstack->context, 1)) {
                     return -1;
                 }
                 return 0;
@@ -1375,6 +1428,11 @@ Tokenizer_handle_tag_close_open(memory_arena_t *a,
     if (Tokenizer_emit(a, self, &cls_tok))
         return 1;
 
+    // The name follows the TagOpenOpen at the bottom of the stack.
+    Token *tokens = self->tokens.tokens + self->topstack->start;
+    if (self->topstack->len > 1 && tokens[1].type == Text)
+        tokens[0].ctx.name.id = Tokenizer_intern_tag_name(a, self, &tokens[1]);
+
     self->head++;
     return 0;
 }
@@ -1520,7 +1578,7 @@ Tokenizer_handle_blacklisted_tag(memory_arena_t *a, Tokenizer *self)
                 no_matching_end:
                     Textbuffer_dealloc(a, buffer);
                     self->head = reset;
-                    if (Tokenizer_emit_text(a, self, "</"))
+                    if (Tokenizer_emit_run(a, self, self->text.data + reset - 1, 2))
                         return NULL;
                     break;
                 }
@@ -1663,6 +1721,7 @@ Tokenizer_really_parse_tag(memory_arena_t *a, Tokenizer *self)
         return NULL;
     }
     TOKEN(tag_open_open, TagOpenOpen);
+    tag_open_open.offset = self->head - 1;
     if (Tokenizer_emit(a, self, &tag_open_open)) {
         TagData_dealloc(a, data);
         return NULL;
@@ -1693,18 +1752,17 @@ Tokenizer_really_parse_tag(memory_arena_t *a, Tokenizer *self)
             }
             TagData_dealloc(a, data);
             self->topstack->context = LC_TAG_BODY;
-            if (self->topstack == NULL || self->topstack->tokenlist == NULL ||
-                self->topstack->tokenlist->len <= 1) {
+            if (self->topstack == NULL || self->topstack->len <= 1) {
                 return NULL;
             }
-            Token token = self->topstack->tokenlist->tokens[1];
+            Token token = self->tokens.tokens[self->topstack->start + 1];
             if (token.type != Text)
                 return NULL;
             char *text = token.ctx.data;
-            if (is_single_only(text, strlen(text))) {
+            if (is_single_only(text, token.length)) {
                 return Tokenizer_handle_single_only_tag_end(self);
             }
-            if (is_parsable(text, strlen(text))) {
+            if (is_parsable(text, token.length)) {
                 return Tokenizer_parse(a, self, 0, 0);
             }
             return Tokenizer_handle_blacklisted_tag(a, self);
@@ -1716,10 +1774,15 @@ Tokenizer_really_parse_tag(memory_arena_t *a, Tokenizer *self)
             TagData_dealloc(a, data);
             return Tokenizer_pop(a, self);
         } else {
-            if (Tokenizer_handle_tag_data(a, self, data, this) || BAD_ROUTE) {
+            if (Tokenizer_handle_tag_data(a, self, data, this)) {
                 TagData_dealloc(a, data);
                 return NULL;
             }
+            if (BAD_ROUTE) {
+                // The buffers in data may have grown inside the failed route;
+                // the caller rolls back to before data was created.
+                return NULL;
+            }
         }
         self->head++;
     }
@@ -1743,7 +1806,7 @@ Tokenizer_handle_invalid_tag_start(memory_arena_t *a, Tokenizer *self)
 
     while (true) {
         char this = Tokenizer_read(self, pos);
-        if (isspace(this) || is_marker(this)) {
+        if (char_is(this, CC_MARKER_SPACE)) {
             if (!is_single_only(buf->data, buf->length))
                 FAIL_ROUTE(0);
             break;
@@ -1753,13 +1816,17 @@ Tokenizer_handle_invalid_tag_start(memory_arena_t *a, Tokenizer *self)
     }
     Textbuffer_dealloc(a, buf);
     TokenList *tag;
+    int depth = self->depth;
+    arena_mark_t mark = arena_mark(a);
     if (!BAD_ROUTE) {
         tag = Tokenizer_really_parse_tag(a, self);
     }
     if (BAD_ROUTE) {
         RESET_ROUTE();
         self->head = reset;
-        return Tokenizer_emit_text(a, self, "</");
+        Tokenizer_drop_stacks(self, depth);
+        arena_release_to(a, mark);
+        return Tokenizer_emit_run(a, self, self->text.data + reset - 1, 2);
     }
     if (!tag) {
         return 1;
@@ -1781,12 +1848,17 @@ static int
 Tokenizer_parse_tag(memory_arena_t *a, Tokenizer *self)
 {
     size_t reset = self->head;
+    int depth = self->depth;
+    arena_mark_t mark = arena_mark(a);
 
     self->head++;
     TokenList *tag = Tokenizer_really_parse_tag(a, self);
     if (BAD_ROUTE) {
         RESET_ROUTE();
         self->head = reset;
+        // A route failing inside the tag can leave the tag's own stack open.
+        Tokenizer_drop_stacks(self, depth);
+        arena_release_to(a, mark);
         return Tokenizer_emit_char(a, self, '<');
     }
     if (!tag)
@@ -1868,21 +1940,23 @@ Tokenizer_parse_italics(memory_arena_t *a, Tokenizer *self)
             if (BAD_ROUTE) {
                 RESET_ROUTE();
                 self->head = reset;
-                return Tokenizer_emit_text(a, self, "''");
+                return Tokenizer_emit_run(a, self, self->text.data + reset - 2, 2);
             }
         } else {
-            return Tokenizer_emit_text(a, self, "''");
+            return Tokenizer_emit_run(a, self, self->text.data + reset - 2, 2);
         }
     }
     if (!stack)
         return 1;
 
     TOKEN(italics, ItalicOpen)
+    italics.offset = reset - 2;
     if (Tokenizer_emit(a, self, &italics))
         return 1;
     if (Tokenizer_emit_all(a, self, stack))
         return 1;
     TOKEN(italics_close, ItalicClose)
+    italics_close.offset = self->head - 2;
     if (Tokenizer_emit(a, self, &italics_close))
         return 1;
     return 0;
@@ -1901,13 +1975,13 @@ Tokenizer_parse_bold(memory_arena_t *a, Tokenizer *self)
         RESET_ROUTE();
         self->head = reset;
         if (self->topstack->context & LC_STYLE_SECOND_PASS) {
-            return Tokenizer_emit_char(a, self, '\'');
+            return Tokenizer_emit_run(a, self, self->text.data + reset - 3, 1);
         }
         if (self->topstack->context & LC_STYLE_ITALICS) {
             self->topstack->context |= LC_STYLE_PASS_AGAIN;
-            return Tokenizer_emit_text(a, self, "'''");
+            return Tokenizer_emit_run(a, self, self->text.data + reset - 3, 3);
         }
-        if (Tokenizer_emit_char(a, self, '\'')) {
+        if (Tokenizer_emit_run(a, self, self->text.data + reset - 3, 1)) {
             return -1;
         }
         return Tokenizer_parse_italics(a, self);
@@ -1916,11 +1990,13 @@ Tokenizer_parse_bold(memory_arena_t *a, Tokenizer *self)
         return -1;
 
     TOKEN(bold, BoldOpen)
+    bold.offset = reset - 3;
     if (Tokenizer_emit(a, self, &bold))
         return 1;
     if (Tokenizer_emit_all(a, self, stack))
         return 1;
     TOKEN(bold_close, BoldClose)
+    bold_close.offset = self->head - 3;
     if (Tokenizer_emit(a, self, &bold_close))
         return 1;
     return 0;
@@ -1932,11 +2008,12 @@ Tokenizer_parse_bold(memory_arena_t *a, Tokenizer *self)
 static int
 Tokenizer_parse_italics_and_bold(memory_arena_t *a, Tokenizer *self)
 {
-    size_t reset = self->head;
+    size_t reset = self->head, start = reset - 5;
     TOKEN(italic_open, ItalicOpen)
     TOKEN(italic_close, ItalicClose)
     TOKEN(bold_open, BoldOpen)
     TOKEN(bold_close, BoldClose)
+    italic_open.offset = bold_open.offset = start;
 
     TokenList *stack = Tokenizer_parse(a, self, LC_STYLE_BOLD, 1);
     if (BAD_ROUTE) {
@@ -1946,17 +2023,19 @@ Tokenizer_parse_italics_and_bold(memory_arena_t *a, Tokenizer *self)
         if (BAD_ROUTE) {
             RESET_ROUTE();
             self->head = reset;
-            return Tokenizer_emit_text(a, self, "'''''");
+            return Tokenizer_emit_run(a, self, self->text.data + start, 5);
         }
         if (!stack) {
             return -1;
         }
         reset = self->head;
+        italic_open.offset = start + 3;
+        italic_close.offset = self->head - 2;
         TokenList *stack2 = Tokenizer_parse(a, self, LC_STYLE_BOLD, 1);
         if (BAD_ROUTE) {
             RESET_ROUTE();
             self->head = reset;
-            if (Tokenizer_emit_text(a, self, "'''")) {
+            if (Tokenizer_emit_run(a, self, self->text.data + start, 3)) {
                 return 1;
             }
             if (Tokenizer_emit(a, self, &italic_open))
@@ -1990,6 +2069,8 @@ Tokenizer_parse_italics_and_bold(memory_arena_t *a, Tokenizer *self)
             return 1;
         }
 
+        italic_open.offset = start;
+        italic_close.offset = self->head - 3;
         if (Tokenizer_emit(a, self, &italic_open))
             return 1;
         if (Tokenizer_emit_all(a, self, stack2))
@@ -2002,11 +2083,13 @@ Tokenizer_parse_italics_and_bold(memory_arena_t *a, Tokenizer *self)
         return 1;
     }
     reset = self->head;
+    bold_open.offset = start + 2;
+    bold_close.offset = self->head - 3;
     TokenList *stack2 = Tokenizer_parse(a, self, LC_STYLE_ITALICS, 1);
     if (BAD_ROUTE) {
         RESET_ROUTE();
         self->head = reset;
-        if (Tokenizer_emit_text(a, self, "''")) {
+        if (Tokenizer_emit_run(a, self, self->text.data + start, 2)) {
             return 1;
         }
         if (Tokenizer_emit(a, self, &bold_open))
@@ -2039,6 +2122,7 @@ Tokenizer_parse_italics_and_bold(memory_arena_t *a, Tokenizer *self)
         return 1;
     }
 
+    italic_close.offset = self->head - 2;
     if (Tokenizer_emit(a, self, &italic_open))
         return 1;
     if (Tokenizer_emit_all(a, self, stack2))
@@ -2061,17 +2145,15 @@ Tokenizer_parse_style(memory_arena_t *a, Tokenizer *self)
         self->head++;
         ticks++;
     }
+    // Ticks past the ones that mean something are text.
     if (ticks > 5) {
-        for (i = 0; i < ticks - 5; i++) {
-            if (Tokenizer_emit_char(a, self, '\'')) {
-                return NULL;
-            }
-        }
+        const char *extra = self->text.data + self->head - ticks;
+        if (Tokenizer_emit_run(a, self, extra, ticks - 5))
+            return NULL;
         ticks = 5;
     } else if (ticks == 4) {
-        if (Tokenizer_emit_char(a, self, '\'')) {
+        if (Tokenizer_emit_run(a, self, self->text.data + self->head - 4, 1))
             return NULL;
-        }
         ticks = 3;
     }
     if ((context & LC_STYLE_ITALICS && (ticks == 2 || ticks == 5)) ||
@@ -2185,6 +2267,7 @@ Tokenizer_handle_hr(memory_arena_t *a, Tokenizer *self)
     // Textbuffer *buffer = Textbuffer_new(&self->text);
     // assert(buffer);
     int i;
+    size_t reset = self->head;
 
     self->head += 3;
     // for (i = 0; i < 4; i++) {
@@ -2201,6 +2284,7 @@ Tokenizer_handle_hr(memory_arena_t *a, Tokenizer *self)
     // Textbuffer_dealloc(buffer);
 
     TOKEN(horizontal_rule, HR)
+    horizontal_rule.offset = reset;
     if (Tokenizer_emit(a, self, &horizontal_rule))
         return 1;
     return 0;
@@ -2643,9 +2727,9 @@ Tokenizer_handle_end(memory_arena_t *a, Tokenizer *self, uint64_t context)
 {
     if (context & AGG_FAIL) {
         if (context & LC_TAG_BODY) {
-            if (self->topstack->tokenlist->len < 2)
+            if (self->topstack->len < 2)
                 return NULL;
-            Token token = self->topstack->tokenlist->tokens[1];
+            Token token = self->tokens.tokens[self->topstack->start + 1];
             puts("LC_TAG_BODY not implemented yet");
             exit(1);
             return NULL;
@@ -2719,13 +2803,13 @@ Tokenizer_verify_safe(Tokenizer *self, uint64_t context, char data)
         }
         if (context & LC_HAS_TEXT) {
             if (context & LC_FAIL_ON_TEXT) {
-                if (!isspace(data)) {
+                if (!char_is(data, CC_SPACE)) {
                     return -1;
                 }
             } else if (data == '\n') {
                 self->topstack->context |= LC_FAIL_ON_TEXT;
             }
-        } else if (!isspace(data)) {
+        } else if (!char_is(data, CC_SPACE)) {
             self->topstack->context |= LC_HAS_TEXT;
         }
     } else {
@@ -2760,47 +2844,82 @@ Tokenizer_verify_safe(Tokenizer *self, uint64_t context, char data)
 }
 
 /*
-    Returns whether the current head has leading whitespace.
+    Returns whether the current head has leading whitespace. What is learned
+    about the line is kept in self->line, so going back never passes the part
+    of the line an earlier call already looked at, such as the blanks before
+    the cells of a table row.
     TODO: treat comments and templates as whitespace, allow fail on non-newline
    spaces.
 */
 static int
 Tokenizer_has_leading_whitespace(Tokenizer *self)
 {
-    int offset = 1;
-    char current_character;
-    while (1) {
-        current_character = Tokenizer_read_backwards(self, offset);
-        if (!current_character || current_character == '\n') {
-            return 1;
-        } else if (!isspace(current_character)) {
-            return 0;
-        }
-        offset++;
+    LineIndex *line = &self->line;
+    const char *data = self->text.data;
+    size_t head = self->head;
+
+    if (head < line->line_start) {
+        memset(line, 0, sizeof(LineIndex));
+    } else if (head <= line->scanned) {
+        return line->blank_end >= head;
+    }
+
+    // Go back to the first character that decides, or to the known part.
+    size_t start = head;
+    while (start > line->scanned) {
+        char before = data[start - 1];
+        if (before == '\n' || !char_is(before, CC_SPACE))
+            break;
+        start--;
     }
+    if (start > line->scanned) {
+        char before = data[start - 1];
+        line->line_start = start;
+        line->blank_end = before == '\n' || before == '\0' ? head : start - 1;
+    } else if (line->blank_end == line->scanned) {
+        line->blank_end = head;
+    }
+    line->scanned = head;
+    return line->blank_end >= head;
+}
+
+/*
+    Remember the current state of the outermost stack as a safe point.
+*/
+static inline void
+Tokenizer_save_safe_point(Tokenizer *self)
+{
+    self->safe_point.saved = 1;
+    self->safe_point.head = self->head;
+    self->safe_point.tokens = self->topstack->len;
+    self->safe_point.text = self->topstack->textbuffer->length;
 }
 
 /*
     Parse the wikicode string, using context for when to stop. If push is true,
     we will push a new context, otherwise we won't and context will be ignored.
 */
-TokenList *
-Tokenizer_parse(memory_arena_t *a, Tokenizer *self, uint64_t context, int push)
+static TokenList *
+Tokenizer_really_parse(memory_arena_t *a, Tokenizer *self, uint64_t context, int push)
 {
-    assert(a->capacity > 0);
+    assert(a->head);
     uint64_t this_context;
     char this, next, next_next, last;
     void *temp;
 
     if (push) {
-        if (Tokenizer_check_route(self, context) < 0) {
-            return NULL;
-        }
-        if (Tokenizer_push(a, self, context)) {
+        // Leave room for the token that opens the construct.
+        if (Tokenizer_push_reserving(a, self, context, 1)) {
             return NULL;
         }
     }
     while (1) {
+        if (self->depth == 1) {
+            self->bad_routes.floor = self->head;
+            if (a->limit && !a->out_of_space) {
+                Tokenizer_save_safe_point(self);
+            }
+        }
         this = Tokenizer_read(self, 0);
         this_context = self->topstack->context;
         if (this_context & AGG_UNSAFE) {
@@ -2812,10 +2931,21 @@ Tokenizer_parse(memory_arena_t *a, Tokenizer *self, uint64_t context, int push)
             }
         }
         if (!is_marker(this)) {
-            if (Tokenizer_emit_char(a, self, this)) {
+            if (this_context & AGG_UNSAFE) {
+                if (Tokenizer_emit_char(a, self, this)) {
+                    return NULL;
+                }
+                self->head++;
+                continue;
+            }
+            // Nothing looks at the characters up to the next marker, so they
+            // are written as one run.
+            const char *text = self->text.data + self->head;
+            size_t run = 1 + find_marker(text + 1, self->text.length - self->head - 1);
+            if (Tokenizer_emit_run(a, self, text, run)) {
                 return NULL;
             }
-            self->head++;
+            self->head += run;
             continue;
         }
         if (!this) {
@@ -2823,146 +2953,215 @@ Tokenizer_parse(memory_arena_t *a, Tokenizer *self, uint64_t context, int push)
         }
         next = Tokenizer_read(self, 1);
         last = Tokenizer_read_backwards(self, 1);
-        if (this == next && next == '{') {
-            if (Tokenizer_CAN_RECURSE(self)) {
-                if (Tokenizer_parse_template_or_argument(a, self)) {
+
+        // Each marker only checks the conditions that can hold for it, in the
+        // order they are tried in. Anything they do not handle is left to the
+        // table contexts, or written as text.
+        switch (this) {
+        case '{':
+            if (next == '{') {
+                if (Tokenizer_CAN_RECURSE(self)) {
+                    if (Tokenizer_parse_template_or_argument(a, self)) {
+                        return NULL;
+                    }
+                } else if (Tokenizer_emit_char(a, self, this)) {
                     return NULL;
                 }
-            } else if (Tokenizer_emit_char(a, self, this)) {
-                return NULL;
-            }
-        } else if (this == '|' && this_context & LC_TEMPLATE) {
-            if (Tokenizer_handle_template_param(a, self)) {
-                return NULL;
-            }
-        } else if (this == '=' && this_context & LC_TEMPLATE_PARAM_KEY) {
-            if (!(self->global & GL_HEADING) && (!last || last == '\n') &&
-                next == '=') {
-                if (Tokenizer_parse_heading(a, self)) {
+            } else if (next == '|' && Tokenizer_has_leading_whitespace(self)) {
+                // Start of table parsing
+                if (Tokenizer_CAN_RECURSE(self)) {
+                    if (Tokenizer_parse_table(a, self)) {
+                        return NULL;
+                    }
+                } else if (Tokenizer_emit_char(a, self, this)) {
                     return NULL;
                 }
-            } else if (Tokenizer_handle_template_param_value(a, self)) {
-                return NULL;
-            }
-        } else if (this == next && next == '}' && this_context & LC_TEMPLATE) {
-            return Tokenizer_handle_template_end(a, self);
-        } else if (this == '|' && this_context & LC_ARGUMENT_NAME) {
-            if (Tokenizer_handle_argument_separator(a, self)) {
-                return NULL;
+            } else {
+                goto other;
             }
-        } else if (this == next && next == '}' && this_context & LC_ARGUMENT) {
-            if (Tokenizer_read(self, 2) == '}') {
-                return Tokenizer_handle_argument_end(a, self);
+            break;
+        case '|':
+            if (this_context & LC_TEMPLATE) {
+                if (Tokenizer_handle_template_param(a, self)) {
+                    return NULL;
+                }
+            } else if (this_context & LC_ARGUMENT_NAME) {
+                if (Tokenizer_handle_argument_separator(a, self)) {
+                    return NULL;
+                }
+            } else if (this_context & LC_WIKILINK_TITLE) {
+                if (Tokenizer_handle_wikilink_separator(a, self)) {
+                    return NULL;
+                }
+            } else {
+                goto other;
             }
-            if (Tokenizer_emit_char(a, self, this)) {
-                return NULL;
+            break;
+        case '=':
+            if (this_context & LC_TEMPLATE_PARAM_KEY) {
+                if (!(self->global & GL_HEADING) && (!last || last == '\n') &&
+                    next == '=') {
+                    if (Tokenizer_parse_heading(a, self)) {
+                        return NULL;
+                    }
+                } else if (Tokenizer_handle_template_param_value(a, self)) {
+                    return NULL;
+                }
+            } else if (!(self->global & GL_HEADING) && !(this_context & LC_TEMPLATE)) {
+                if (!last || last == '\n') {
+                    if (Tokenizer_parse_heading(a, self)) {
+                        return NULL;
+                    }
+                } else if (Tokenizer_emit_char(a, self, this)) {
+                    return NULL;
+                }
+            } else if (this_context & LC_HEADING) {
+                return (void *) Tokenizer_handle_heading_end(a, self);
+            } else {
+                goto other;
             }
-        } else if (this == next && next == '[' && Tokenizer_CAN_RECURSE(self)) {
-            // TODO: Only do this if not in a file context:
-            // if (this_context & LC_WIKILINK_TEXT) {
-            //     return Tokenizer_fail_route(self);
-            // }
-            if (!(this_context & AGG_NO_WIKILINKS)) {
-                if (Tokenizer_parse_wikilink(a, self)) {
+            break;
+        case '}':
+            if (next == '}' && this_context & LC_TEMPLATE) {
+                return Tokenizer_handle_template_end(a, self);
+            } else if (next == '}' && this_context & LC_ARGUMENT) {
+                if (Tokenizer_read(self, 2) == '}') {
+                    return Tokenizer_handle_argument_end(a, self);
+                }
+                if (Tokenizer_emit_char(a, self, this)) {
                     return NULL;
                 }
-            } else if (Tokenizer_emit_char(a, self, this)) {
-                return NULL;
+            } else {
+                goto other;
             }
-        } else if (this == '|' && this_context & LC_WIKILINK_TITLE) {
-            if (Tokenizer_handle_wikilink_separator(a, self)) {
+            break;
+        case '[':
+            if (next == '[' && Tokenizer_CAN_RECURSE(self)) {
+                // TODO: Only do this if not in a file context:
+                // if (this_context & LC_WIKILINK_TEXT) {
+                //     return Tokenizer_fail_route(self);
+                // }
+                if (!(this_context & AGG_NO_WIKILINKS)) {
+                    if (Tokenizer_parse_wikilink(a, self)) {
+                        return NULL;
+                    }
+                } else if (Tokenizer_emit_char(a, self, this)) {
+                    return NULL;
+                }
+            } else if (Tokenizer_parse_external_link(a, self, 1)) {
                 return NULL;
             }
-        } else if (this == next && next == ']' && this_context & LC_WIKILINK) {
-            return Tokenizer_handle_wikilink_end(a, self);
-        } else if (this == '[') {
-            if (Tokenizer_parse_external_link(a, self, 1)) {
-                return NULL;
+            break;
+        case ']':
+            if (next == ']' && this_context & LC_WIKILINK) {
+                return Tokenizer_handle_wikilink_end(a, self);
+            } else if (this_context & LC_EXT_LINK_TITLE) {
+                return Tokenizer_pop(a, self);
             }
-        } else if (this == ':' && !is_marker(last)) {
-            if (Tokenizer_parse_external_link(a, self, 0)) {
-                return NULL;
+            goto other;
+        case ':':
+            if (!is_marker(last)) {
+                if (Tokenizer_parse_external_link(a, self, 0)) {
+                    return NULL;
+                }
+            } else if (!last || last == '\n') {
+                if (Tokenizer_handle_list(a, self)) {
+                    return NULL;
+                }
+            } else if (this_context & LC_DLTERM) {
+                if (Tokenizer_handle_dl_term(a, self)) {
+                    return NULL;
+                }
+            } else {
+                goto other;
             }
-        } else if (this == ']' && this_context & LC_EXT_LINK_TITLE) {
-            return Tokenizer_pop(a, self);
-        } else if (this == '=' && !(self->global & GL_HEADING) &&
-                   !(this_context & LC_TEMPLATE)) {
+            break;
+        case '#':
+        case '*':
+        case ';':
             if (!last || last == '\n') {
-                if (Tokenizer_parse_heading(a, self)) {
+                if (Tokenizer_handle_list(a, self)) {
                     return NULL;
                 }
-            } else if (Tokenizer_emit_char(a, self, this)) {
-                return NULL;
-            }
-        } else if (this == '=' && this_context & LC_HEADING) {
-            return (void *) Tokenizer_handle_heading_end(a, self);
-        } else if (this == '\n' && this_context & LC_HEADING) {
-            return Tokenizer_fail_route(a, self);
-        } else if (this == '&') {
-            if (Tokenizer_parse_entity(a, self)) {
-                return NULL;
+                break;
             }
-        } else if (this == '<' && next == '!') {
-            next_next = Tokenizer_read(self, 2);
-            if (next_next == Tokenizer_read(self, 3) && next_next == '-') {
-                if (Tokenizer_parse_comment(a, self)) {
+            goto other;
+        case '-':
+            if ((!last || last == '\n') && next == '-' &&
+                Tokenizer_read(self, 2) == '-' && Tokenizer_read(self, 3) == '-') {
+                if (Tokenizer_handle_hr(a, self)) {
                     return NULL;
                 }
-            } else if (Tokenizer_emit_char(a, self, this)) {
-                return NULL;
-            }
-        } else if (this == '<' && next == '/' && Tokenizer_read(self, 2)) {
-            if (this_context & LC_TAG_BODY
-                    ? Tokenizer_handle_tag_open_close(a, self)
-                    : Tokenizer_handle_invalid_tag_start(a, self)) {
-                return NULL;
+                break;
             }
-        } else if (this == '<' && !(this_context & LC_TAG_CLOSE)) {
-            if (Tokenizer_CAN_RECURSE(self)) {
-                if (Tokenizer_parse_tag(a, self)) {
+            goto other;
+        case '\n':
+            if (this_context & LC_HEADING) {
+                return Tokenizer_fail_route(a, self);
+            } else if (this_context & LC_DLTERM) {
+                if (Tokenizer_handle_dl_term(a, self)) {
                     return NULL;
                 }
-            } else if (Tokenizer_emit_char(a, self, this)) {
-                return NULL;
-            }
-        } else if (this == '>' && this_context & LC_TAG_CLOSE) {
-            return Tokenizer_handle_tag_close_close(self);
-        } else if (this == next && next == '\'' && !self->skip_style_tags) {
-            TokenList *intermediate = Tokenizer_parse_style(a, self);
-            if (intermediate)
-                return intermediate;
-            // Otherwise, text was emitted in `Tokenizer_parse_style`
-        } else if ((!last || last == '\n') &&
-                   (this == '#' || this == '*' || this == ';' || this == ':')) {
-            if (Tokenizer_handle_list(a, self)) {
-                return NULL;
+                // Kill potential table contexts
+                self->topstack->context &= ~LC_TABLE_CELL_LINE_CONTEXTS;
+                break;
             }
-        } else if ((!last || last == '\n') &&
-                   (this == '-' && this == next && this == Tokenizer_read(self, 2) &&
-                    this == Tokenizer_read(self, 3))) {
-            if (Tokenizer_handle_hr(a, self)) {
+            goto other;
+        case '&':
+            if (Tokenizer_parse_entity(a, self)) {
                 return NULL;
             }
-        } else if ((this == '\n' || this == ':') && this_context & LC_DLTERM) {
-            if (Tokenizer_handle_dl_term(a, self)) {
-                return NULL;
+            break;
+        case '<':
+            if (next == '!') {
+                next_next = Tokenizer_read(self, 2);
+                if (next_next == Tokenizer_read(self, 3) && next_next == '-') {
+                    if (Tokenizer_parse_comment(a, self)) {
+                        return NULL;
+                    }
+                } else if (Tokenizer_emit_char(a, self, this)) {
+                    return NULL;
+                }
+            } else if (next == '/' && Tokenizer_read(self, 2)) {
+                if (this_context & LC_TAG_BODY
+                        ? Tokenizer_handle_tag_open_close(a, self)
+                        : Tokenizer_handle_invalid_tag_start(a, self)) {
+                    return NULL;
+                }
+            } else if (!(this_context & LC_TAG_CLOSE)) {
+                if (Tokenizer_CAN_RECURSE(self)) {
+                    if (Tokenizer_parse_tag(a, self)) {
+                        return NULL;
+                    }
+                } else if (Tokenizer_emit_char(a, self, this)) {
+                    return NULL;
+                }
+            } else {
+                goto other;
             }
-            // Kill potential table contexts
-            if (this == '\n') {
-                self->topstack->context &= ~LC_TABLE_CELL_LINE_CONTEXTS;
+            break;
+        case '>':
+            if (this_context & LC_TAG_CLOSE) {
+                return Tokenizer_handle_tag_close_close(self);
+            }
+            goto other;
+        case '\'':
+            if (next == '\'' && !self->skip_style_tags) {
+                TokenList *intermediate = Tokenizer_parse_style(a, self);
+                if (intermediate)
+                    return intermediate;
+                // Otherwise, text was emitted in `Tokenizer_parse_style`
+                break;
             }
+            goto other;
+        default:
+            goto other;
         }
+        self->head++;
+        continue;
 
-        // Start of table parsing
-        else if (this == '{' && next == '|' && Tokenizer_has_leading_whitespace(self)) {
-            if (Tokenizer_CAN_RECURSE(self)) {
-                if (Tokenizer_parse_table(a, self)) {
-                    return NULL;
-                }
-            } else if (Tokenizer_emit_char(a, self, this)) {
-                return NULL;
-            }
-        } else if (this_context & LC_TABLE_OPEN) {
+    other:
+        if (this_context & LC_TABLE_OPEN) {
             if (this == '|' && next == '|' && this_context & LC_TABLE_TD_LINE) {
                 if (this_context & LC_TABLE_CELL_OPEN) {
                     return Tokenizer_handle_table_cell_end(a, self, 0);
@@ -3042,3 +3241,97 @@ Tokenizer_parse(memory_arena_t *a, Tokenizer *self, uint64_t context, int push)
         self->head++;
     }
 }
+
+/*
+    Give up on the routes in progress after the arena reached its limit.
+    The outermost stack is rolled back to its last safe point and the rest
+    of the text is written to it as plain text. Only the outermost stack is
+    ever appended to while a safe point is current, so the text that was
+    pending at the safe point is either still in the textbuffer or at the
+    start of the first token added since.
+*/
+static TokenList *
+Tokenizer_degrade(memory_arena_t *a, Tokenizer *self)
+{
+    SafePoint *safe = &self->safe_point;
+
+    // Errors that were recovered from may have closed the outermost stack.
+    if (!safe->saved || self->depth == 0) {
+        return NULL;
+    }
+    Stack *stack = &self->frames[0];
+
+    Token *tokens = self->tokens.tokens + stack->start;
+    Textbuffer *textbuffer = stack->textbuffer;
+    const char *pending = NULL;
+    if (stack->len > safe->tokens && safe->text > 0 &&
+        tokens[safe->tokens].type == Text) {
+        pending = tokens[safe->tokens].ctx.data;
+        Textbuffer_reset(textbuffer);
+    } else {
+        textbuffer->length = safe->text;
+    }
+    stack->len = safe->tokens;
+    self->tokens.len = stack->start + stack->len;
+    self->popped_len = 0;
+
+    self->topstack = stack;
+    self->depth = 1;
+    self->head = safe->head;
+    RESET_ROUTE();
+
+    // The limit has already been reached; the rest of the text needs at most
+    // its own size.
+    size_t limit = a->limit;
+    a->limit = 0;
+    a->out_of_space = 0;
+    TokenList *result = NULL;
+    if (pending && Tokenizer_emit_run(a, self, pending, safe->text)) {
+        goto done;
+    }
+    if (Tokenizer_emit_run(
+            a, self, self->text.data + self->head, self->text.length - self->head)) {
+        goto done;
+    }
+    self->head = self->text.length;
+    result = Tokenizer_pop(a, self);
+    self->degraded = 1;
+
+done:
+    a->limit = limit;
+    return result;
+}
+
+/*
+    Parse the wikicode string, using context for when to stop. If push is true,
+    we will push a new context, otherwise we won't and context will be ignored.
+
+    Return NULL on failure. If the arena's out_of_space flag is set, parsing
+    stopped because memory ran out, which for an arena made with
+    arena_init_buffer() means the text may be retried with a larger buffer.
+
+    If the arena has a limit and reaches it, the outermost call does not
+    fail. Instead, everything from the last completed top-level construct
+    onwards is emitted as plain text and self->degraded is set.
+*/
+TokenList *
+Tokenizer_parse(memory_arena_t *a, Tokenizer *self, uint64_t context, int push)
+{
+    if (!push || self->topstack) {
+        return Tokenizer_really_parse(a, self, context, push);
+    }
+
+    self->safe_point.saved = 0;
+    self->degraded = 0;
+
+    // Some errors are recovered from deep inside the parser, so a result can
+    // come back even though an allocation failed on the way.
+    TokenList *tokens = Tokenizer_really_parse(a, self, context, push);
+    if (!a->out_of_space) {
+        return tokens;
+    }
+    if (a->limit && !a->fixed) {
+        return Tokenizer_degrade(a, self);
+    }
+    return NULL;
+}
@@ -26,6 +26,7 @@ SOFTWARE.
 #include "memoryarena.h"
 #include "tok_support.h"
 
+// The same characters are in the CC_MARKER class of charclass.h.
 static const char MARKERS[] = {
     '{',
     '}',
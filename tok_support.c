@@ -21,31 +21,349 @@ SOFTWARE.
 */
 
 #include "tok_support.h"
+#include "charclass.h"
 #include "common.h"
 #include "memoryarena.h"
+#include "stringtable.h"
 #include "textbuffer.h"
 #include "tokenlist.h"
 
 /*
-    Add a new token stack, context, and textbuffer to the list.
+    Learn from the document that was just parsed how much room the next one
+    should be given. The ratio of tokens to input is averaged over recent
+    documents, so one unusual document does not throw it off.
+*/
+static void
+Tokenizer_learn_sizes(Tokenizer *self)
+{
+    if (!self->text.length || !self->tokens.len)
+        return;
+
+    uint64_t per_kb = (uint64_t) self->tokens.len * 1024 / self->text.length;
+    if (per_kb > UINT32_MAX)
+        per_kb = UINT32_MAX;
+    if (self->tokens_per_kb)
+        per_kb = (per_kb + (uint64_t) self->tokens_per_kb * 3) / 4;
+    self->tokens_per_kb = (uint32_t) per_kb;
+}
+
+/*
+    Prepare the tokenizer and its arena for a new document. Anything left
+    from the previous document is given back to the arena, which keeps its
+    blocks (up to its high_water mark) so that parsing many small documents
+    does not go back to the system allocator each time. The arena must have
+    been set up with arena_init() before the first call. The text is taken
+    as unpadded; a caller that guarantees padding sets text.padded after.
+
+    Return 0 on success and -1 if the arena could not be set up again.
+*/
+int
+Tokenizer_reset(memory_arena_t *a, Tokenizer *self, const char *text, size_t length)
+{
+    assert(self);
+
+    Tokenizer_learn_sizes(self);
+    if (arena_reset(a)) {
+        return -1;
+    }
+
+    self->text.data = text;
+    self->text.length = length;
+    self->text.padded = false;
+    self->topstack = NULL;
+    self->frames = NULL;
+    self->frames_size = 0;
+    self->tokens.tokens = NULL;
+    self->tokens.len = 0;
+    self->tokens.capacity = 0;
+    self->popped = NULL;
+    self->popped_len = 0;
+    self->popped_size = 0;
+    self->head = 0;
+    self->global = 0;
+    self->depth = 0;
+    self->route_state = 0;
+    self->route_context = 0;
+    memset(&self->line, 0, sizeof(LineIndex));
+    Tokenizer_clear_bad_routes(self);
+    StringTable_init(&self->names, self->names.base);
+    return 0;
+}
+
+#define INITIAL_FRAMES 16
+
+/*
+    Make room for one more frame. The frames move, so topstack is updated.
+*/
+static int
+Tokenizer_grow_frames(memory_arena_t *a, Tokenizer *self)
+{
+    int size = self->frames_size ? self->frames_size * 2 : INITIAL_FRAMES;
+    Stack *frames = self->frames
+                        ? arena_reallocarray(a, self->frames, size, sizeof(Stack))
+                        : arena_alloc_pinned(a, size * sizeof(Stack), ARENA_STACK);
+    if (!frames)
+        return -1;
+    memset(frames + self->frames_size, 0, (size - self->frames_size) * sizeof(Stack));
+
+    self->frames = frames;
+    self->frames_size = size;
+    if (self->depth)
+        self->topstack = &frames[self->depth - 1];
+    return 0;
+}
+
+#define INITIAL_TOKENS 32
+
+/*
+    Make room for at least size tokens in the shared token list. The tokens
+    move, so the popped stacks that are still in it are updated.
+*/
+static int
+Tokenizer_grow_tokens(memory_arena_t *a, Tokenizer *self, size_t size)
+{
+    TokenList *list = &self->tokens;
+    size_t capacity = list->capacity ? list->capacity : INITIAL_TOKENS;
+
+    if (size <= list->capacity)
+        return 0;
+    while (capacity < size)
+        capacity *= 2;
+    Token *tokens;
+    if (list->tokens)
+        tokens = arena_reallocarray(a, list->tokens, capacity, sizeof(Token));
+    else
+        tokens = arena_alloc_pinned(a, capacity * sizeof(Token), ARENA_TOKENLIST);
+    if (!tokens)
+        return -1;
+
+    list->tokens = tokens;
+    list->capacity = capacity;
+    for (size_t i = 0; i < self->popped_len; i++)
+        self->popped[i].tokens->tokens = tokens + self->popped[i].start;
+    return 0;
+}
+
+/*
+    Return how many bytes the outermost textbuffer is likely to need, going by
+    the last document. Its text is mostly written as spans of the input, so
+    it only grows for text that is not, and never past the input's length.
+*/
+static inline size_t
+Tokenizer_text_estimate(Tokenizer *self)
+{
+    return self->text_capacity < self->text.length ? self->text_capacity
+                                                   : self->text.length;
+}
+
+/*
+    Make room in the shared token list for as many tokens as recent documents
+    had for their length, so that a large document does not have to grow it
+    one doubling at a time. The estimate is a little generous, as a list that
+    grows once more costs a copy of all of it. Running out of space here is
+    not an error, as the list can still grow as it is written.
+*/
+static void
+Tokenizer_presize_tokens(memory_arena_t *a, Tokenizer *self)
+{
+    size_t length = self->text.length;
+    if (!self->tokens_per_kb || length > SIZE_MAX / 2 / self->tokens_per_kb)
+        return;
+    size_t size = length * self->tokens_per_kb / 1024;
+    size += size / 8;
+    if (size <= INITIAL_TOKENS * 2)
+        return;
+
+    int out_of_space = a->out_of_space;
+    if (Tokenizer_grow_tokens(a, self, size))
+        a->out_of_space = out_of_space;
+}
+
+/*
+    Return the index of the first popped stack that belongs to the top stack,
+    or popped_len if there is none. It is the nearest one after its tokens.
+*/
+static inline size_t
+Tokenizer_first_popped(Tokenizer *self)
+{
+    size_t i = self->popped_len;
+
+    while (i > 0 && self->popped[i - 1].depth == self->depth)
+        i--;
+    return i;
+}
+
+/*
+    Return the index of the given popped stack, or popped_len if its tokens
+    are not in the shared list.
+*/
+static size_t
+Tokenizer_find_popped(Tokenizer *self, TokenList *tokenlist)
+{
+    for (size_t i = self->popped_len; i > 0; i--) {
+        if (self->popped[i - 1].tokens == tokenlist)
+            return i - 1;
+    }
+    return self->popped_len;
+}
+
+static void
+Tokenizer_forget_popped(Tokenizer *self, size_t i)
+{
+    memmove(&self->popped[i], &self->popped[i + 1],
+            (self->popped_len - i - 1) * sizeof(PoppedStack));
+    self->popped_len--;
+}
+
+/*
+    Copy the tokens of a popped stack out of the shared list, so that the
+    stack below it can write over them.
+*/
+static int
+Tokenizer_evict_popped(memory_arena_t *a, Tokenizer *self, size_t i)
+{
+    TokenList *tokenlist = self->popped[i].tokens;
+    if (tokenlist->len) {
+        Token *tokens =
+            arena_alloc(a, tokenlist->len * sizeof(Token), ARENA_TOKENLIST);
+        if (!tokens)
+            return -1;
+        memcpy(tokens, tokenlist->tokens, tokenlist->len * sizeof(Token));
+        tokenlist->tokens = tokens;
+        tokenlist->capacity = tokenlist->len;
+    }
+    Tokenizer_forget_popped(self, i);
+    return 0;
+}
+
+/*
+    Make room for n more tokens at the end of the top stack, moving the
+    popped stacks that are in the way out of the shared list.
+*/
+static int
+Tokenizer_make_room(memory_arena_t *a, Tokenizer *self, size_t n)
+{
+    size_t end = self->topstack->start + self->topstack->len;
+    size_t first = Tokenizer_first_popped(self);
+
+    while (first < self->popped_len && end + n > self->popped[first].start) {
+        if (Tokenizer_evict_popped(a, self, first))
+            return -1;
+    }
+    if (first == self->popped_len) {
+        // Nothing after the top stack is in use any more.
+        if (Tokenizer_grow_tokens(a, self, end + n))
+            return -1;
+        self->tokens.len = end + n;
+    }
+    return 0;
+}
+
+/*
+    Write a token at the end of the top stack.
+*/
+static int
+Tokenizer_append(memory_arena_t *a, Tokenizer *self, Token *token)
+{
+    Stack *top = self->topstack;
+    size_t end = top->start + top->len;
+
+    // Usually nothing comes after the top stack's tokens yet.
+    if (end == self->tokens.len && end < self->tokens.capacity)
+        self->tokens.len++;
+    else if (Tokenizer_make_room(a, self, 1))
+        return -1;
+    self->tokens.tokens[end] = *token;
+    top->len++;
+    return 0;
+}
+
+/*
+    Remember the tokens of a stack that was just popped, which stay where
+    they are in the shared list until they are written to the top stack.
+*/
+static int
+Tokenizer_add_popped(
+    memory_arena_t *a, Tokenizer *self, TokenList *tokenlist, size_t start)
+{
+    if (self->popped_len == self->popped_size) {
+        size_t size = self->popped_size ? self->popped_size * 2 : INITIAL_FRAMES;
+        PoppedStack *popped =
+            self->popped
+                ? arena_reallocarray(a, self->popped, size, sizeof(PoppedStack))
+                : arena_alloc_pinned(a, size * sizeof(PoppedStack), ARENA_TOKENLIST);
+        if (!popped)
+            return -1;
+        self->popped = popped;
+        self->popped_size = size;
+    }
+
+    PoppedStack *entry = &self->popped[self->popped_len++];
+    entry->tokens = tokenlist;
+    entry->start = start;
+    entry->depth = self->depth;
+    return 0;
+}
+
+/*
+    Add a new token stack, context, and textbuffer to the list. If the route
+    starting here with this context is known to fail, the BAD_ROUTE flag is
+    set instead and -1 is returned, as on an allocation failure.
 */
 int
 Tokenizer_push(memory_arena_t *a, Tokenizer *self, uint64_t context)
+{
+    return Tokenizer_push_reserving(a, self, context, 0);
+}
+
+/*
+    Push a new stack like Tokenizer_push(), leaving room before it for the
+    given number of tokens, which will be written ahead of its own once it
+    is popped. Room for the pending text of the current stack is added. When
+    the guess is right, the stack's tokens never move.
+*/
+int
+Tokenizer_push_reserving(
+    memory_arena_t *a, Tokenizer *self, uint64_t context, size_t reserve)
 {
     assert(self);
 
-    Stack *top = arena_alloc(a, sizeof(Stack));
-    assert(top);
+    if (Tokenizer_check_route(self, context) < 0)
+        return -1;
+
+    if (self->depth == self->frames_size && Tokenizer_grow_frames(a, self))
+        return -1;
+    Stack *top = &self->frames[self->depth];
+    if (!top->textbuffer) {
+        size_t capacity = self->depth ? 0 : Tokenizer_text_estimate(self);
+        top->textbuffer = Textbuffer_new_pinned(a, capacity);
+        if (!top->textbuffer)
+            return -1;
+    }
+
+    size_t base = self->tokens.len;
+    if (self->topstack) {
+        if (Tokenizer_first_popped(self) == self->popped_len)
+            base = self->topstack->start + self->topstack->len;
+        if (self->topstack->textbuffer->length)
+            reserve++;
+    } else {
+        // The outermost stack is never written to another one.
+        reserve = 0;
+        Tokenizer_presize_tokens(a, self);
+    }
+    if (Tokenizer_grow_tokens(a, self, base + reserve + 1))
+        return -1;
+    top->start = base + reserve;
+    top->len = 0;
+    top->reserved = reserve;
+    self->tokens.len = top->start;
 
-    top->tokenlist = TokenList_new(a, 0);
-    assert(top->tokenlist);
+    top->mark = arena_mark(a);
     top->context = context;
-    top->textbuffer = Textbuffer_new(a, &self->text);
-    assert(top->textbuffer);
 
     top->ident.head = self->head;
     top->ident.context = context;
-    top->next = self->topstack;
     self->topstack = top;
     self->depth++;
     return 0;
@@ -66,11 +384,25 @@ Tokenizer_push_textbuffer(memory_arena_t *a, Tokenizer *self)
     if (buffer->length == 0)
         return 0;
 
-    Token t;
-    t.type = Text;
-    t.ctx.data = Textbuffer_export(a, buffer);
-    assert(self->topstack->tokenlist);
-    TokenList_append(a, self->topstack->tokenlist, &t);
+    const char *text = Textbuffer_export(a, buffer);
+    if (!text)
+        return -1;
+
+    // Token lengths are 32 bits, so longer runs take several tokens.
+    size_t length = buffer->length;
+    size_t offset = self->topstack->text_offset;
+    do {
+        Token t;
+        t.type = Text;
+        t.ctx.data = (char *) text;
+        t.length = length < UINT32_MAX ? length : UINT32_MAX;
+        t.offset = offset;
+        if (Tokenizer_append(a, self, &t))
+            return -1;
+        text += t.length;
+        offset += t.length;
+        length -= t.length;
+    } while (length);
 
     Textbuffer_reset(buffer);
 
@@ -78,23 +410,26 @@ Tokenizer_push_textbuffer(memory_arena_t *a, Tokenizer *self)
 }
 
 /*
-    Pop and deallocate the top token stack/context/textbuffer.
+    Pop the top token stack/context/textbuffer. The textbuffer is emptied and
+    kept for the next stack pushed at this depth.
 */
 void
-Tokenizer_delete_top_of_stack(memory_arena_t *a, Tokenizer *self)
+Tokenizer_delete_top_of_stack(Tokenizer *self)
 {
-    Stack *top = self->topstack;
-
-    // TODO: Make sure everything is de-allocated here.
-
-    Textbuffer_dealloc(a, top->textbuffer);
-    self->topstack = top->next;
-    arena_free(a, top);
+    // The outermost textbuffer's size is kept for the next document, as its
+    // frame is gone by the time the tokenizer is reset.
+    if (self->depth == 1)
+        self->text_capacity = self->topstack->textbuffer->capacity;
+    Textbuffer_reset(self->topstack->textbuffer);
+    while (self->popped_len && self->popped[self->popped_len - 1].depth >= self->depth)
+        self->popped_len--;
     self->depth--;
+    self->topstack = self->depth ? &self->frames[self->depth - 1] : NULL;
 }
 
 /*
-    Pop the current stack/context/textbuffer, returing the stack.
+    Pop the current stack/context/textbuffer, returing the stack. Its tokens
+    are left in the shared list, and the list returned refers to them.
 */
 TokenList *
 Tokenizer_pop(memory_arena_t *a, Tokenizer *self)
@@ -106,10 +441,19 @@ Tokenizer_pop(memory_arena_t *a, Tokenizer *self)
     }
 
     assert(self->topstack);
-    assert(self->topstack->tokenlist);
 
-    TokenList *tl = self->topstack->tokenlist;
-    Tokenizer_delete_top_of_stack(a, self);
+    Stack *top = self->topstack;
+    TokenList *tl = arena_alloc(a, sizeof(TokenList), ARENA_TOKENLIST);
+    if (!tl)
+        return NULL;
+    tl->tokens = self->tokens.tokens + top->start;
+    tl->len = top->len;
+    tl->capacity = 0;
+
+    size_t start = top->start;
+    Tokenizer_delete_top_of_stack(self);
+    if (tl->len && Tokenizer_add_popped(a, self, tl, start))
+        return NULL;
     return tl;
 }
 
@@ -120,34 +464,148 @@ Tokenizer_pop(memory_arena_t *a, Tokenizer *self)
 TokenList *
 Tokenizer_pop_keeping_context(memory_arena_t *a, Tokenizer *self)
 {
-    uint64_t context;
+    uint64_t context = self->topstack->context;
 
-    if (Tokenizer_push_textbuffer(a, self)) {
+    TokenList *tl = Tokenizer_pop(a, self);
+    if (!tl)
         return NULL;
-    }
-    TokenList *tl = self->topstack->tokenlist;
-    context = self->topstack->context;
-    Tokenizer_delete_top_of_stack(a, self);
     self->topstack->context = context;
     return tl;
 }
 
+#define ROUTE_SET_INITIAL_SIZE 64
+
+static inline size_t
+route_hash(StackIdent ident)
+{
+    uint64_t h = (uint64_t) ident.head * 0x9E3779B97F4A7C15ULL ^ ident.context;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return (size_t) h;
+}
+
 /*
-    Compare two route_tree_nodes that are in their avl_tree_node forms.
+    Return the slot holding ident, or the empty slot where it would go.
 */
-static int
-compare_nodes(const struct avl_tree_node *na, const struct avl_tree_node *nb)
+static inline StackIdent *
+route_set_find(const RouteSet *set, StackIdent ident)
 {
-    route_tree_node *a = avl_tree_entry(na, route_tree_node, node);
-    route_tree_node *b = avl_tree_entry(nb, route_tree_node, node);
+    size_t i = route_hash(ident) & set->mask;
 
-    if (a->id.head < b->id.head) {
+    while (1) {
+        StackIdent *slot = &set->slots[i];
+        if (slot->head == ROUTE_SET_EMPTY ||
+            (slot->head == ident.head && slot->context == ident.context)) {
+            return slot;
+        }
+        i = (i + 1) & set->mask;
+    }
+}
+
+/*
+    Move the set into a table of the given number of slots. Return -1 if it
+    could not be allocated, in which case the set is left as it was.
+*/
+static int
+route_set_resize(memory_arena_t *a, RouteSet *set, size_t size)
+{
+    StackIdent *slots =
+        arena_alloc_pinned(a, size * sizeof(StackIdent), ARENA_BAD_ROUTE);
+    if (!slots)
         return -1;
+    memset(slots, 0xff, size * sizeof(StackIdent));
+
+    RouteSet grown = {slots, size - 1, 0, set->floor, set->floor};
+    for (size_t i = 0; set->slots && i <= set->mask; i++) {
+        StackIdent ident = set->slots[i];
+        if (ident.head != ROUTE_SET_EMPTY && ident.head >= set->floor) {
+            *route_set_find(&grown, ident) = ident;
+            grown.count++;
+        }
     }
-    if (a->id.head > b->id.head) {
-        return 1;
+    arena_free(a, set->slots);
+    *set = grown;
+    return 0;
+}
+
+/*
+    Empty slot i, moving later idents of its probe sequence back so that
+    lookups still find them.
+*/
+static void
+route_set_delete(RouteSet *set, size_t i)
+{
+    size_t j = i;
+
+    while (1) {
+        j = (j + 1) & set->mask;
+        if (set->slots[j].head == ROUTE_SET_EMPTY)
+            break;
+        // The ident at j may fill the hole only if its home slot is not
+        // between the hole and j.
+        size_t home = route_hash(set->slots[j]) & set->mask;
+        if (((j - home) & set->mask) >= ((j - i) & set->mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    set->slots[i].head = ROUTE_SET_EMPTY;
+    set->count--;
+}
+
+/*
+    Drop the routes that start before the floor.
+*/
+static void
+route_set_prune(RouteSet *set)
+{
+    size_t i = 0;
+
+    while (i <= set->mask) {
+        StackIdent *slot = &set->slots[i];
+        // Deleting moves the next ident of the sequence into slot i, so it
+        // is looked at again.
+        if (slot->head != ROUTE_SET_EMPTY && slot->head < set->floor)
+            route_set_delete(set, i);
+        else
+            i++;
+    }
+    set->pruned = set->floor;
+}
+
+/*
+    Remember that the route with the given ident is invalid. The set is
+    pinned so that it survives the rollback of enclosing routes.
+*/
+static void
+Tokenizer_memoize_route(memory_arena_t *a, Tokenizer *self, StackIdent ident)
+{
+    RouteSet *set = &self->bad_routes;
+
+    // Keep the table at most half full, so probe sequences stay short. It
+    // only grows if dropping old routes leaves it more than a quarter full.
+    int grow = !set->slots;
+    if (set->slots && (set->count + 1) * 2 > set->mask + 1) {
+        if (set->floor > set->pruned)
+            route_set_prune(set);
+        grow = (set->count + 1) * 4 > set->mask + 1;
+    }
+    if (grow) {
+        int out_of_space = a->out_of_space;
+        size_t size = set->slots ? (set->mask + 1) * 2 : ROUTE_SET_INITIAL_SIZE;
+        if (route_set_resize(a, set, size)) {
+            // Not remembering the route only costs time, so it is not an error.
+            a->out_of_space = out_of_space;
+            return;
+        }
+    }
+
+    StackIdent *slot = route_set_find(set, ident);
+    if (slot->head == ROUTE_SET_EMPTY) {
+        *slot = ident;
+        set->count++;
     }
-    return (a->id.context > b->id.context) - (a->id.context < b->id.context);
 }
 
 /*
@@ -159,13 +617,7 @@ compare_nodes(const struct avl_tree_node *na, const struct avl_tree_node *nb)
 void
 Tokenizer_memoize_bad_route(memory_arena_t *a, Tokenizer *self)
 {
-    route_tree_node *node = arena_alloc(a, sizeof(route_tree_node));
-    if (node) {
-        node->id = self->topstack->ident;
-        if (avl_tree_insert(&self->bad_routes, &node->node, compare_nodes)) {
-            arena_free(a, node);
-        }
-    }
+    Tokenizer_memoize_route(a, self, self->topstack->ident);
 }
 
 /*
@@ -173,18 +625,41 @@ Tokenizer_memoize_bad_route(memory_arena_t *a, Tokenizer *self)
     stack/context/textbuffer and sets the BAD_ROUTE flag. Also records the
     ident of the failed stack so future parsing attempts down this route can be
     stopped early.
+
+    Everything allocated since the stack was pushed is given back to the
+    arena and its tokens are dropped from the shared list, so callers must
+    not touch memory obtained during the failed route.
 */
 void *
 Tokenizer_fail_route(memory_arena_t *a, Tokenizer *self)
 {
     uint64_t context = self->topstack->context;
+    StackIdent ident = self->topstack->ident;
+    arena_mark_t mark = self->topstack->mark;
 
-    Tokenizer_memoize_bad_route(a, self);
-    TokenList *stack = Tokenizer_pop(a, self);
+    self->tokens.len = self->topstack->start - self->topstack->reserved;
+    Tokenizer_delete_top_of_stack(self);
+    arena_release_to(a, mark);
+    Tokenizer_memoize_route(a, self, ident);
     FAIL_ROUTE(context);
     return NULL;
 }
 
+/*
+    Drop the stacks above the given depth along with their tokens. A route
+    can fail while stacks it pushed are still open, such as when a push inside
+    it runs into a memoized bad route, and they have to go before the arena
+    is rolled back to where the route started.
+*/
+void
+Tokenizer_drop_stacks(Tokenizer *self, int depth)
+{
+    while (self->depth > depth) {
+        self->tokens.len = self->topstack->start - self->topstack->reserved;
+        Tokenizer_delete_top_of_stack(self);
+    }
+}
+
 /*
     Check if pushing a new route here with the given context would definitely
     fail, based on a previous call to Tokenizer_fail_route() with the same
@@ -193,18 +668,20 @@ Tokenizer_fail_route(memory_arena_t *a, Tokenizer *self)
     Return 0 if safe and -1 if unsafe. The BAD_ROUTE flag will be set in the
     latter case.
 
-    This function is not necessary to call and works as an optimization
-    implementation detail. (The Python tokenizer checks every route on push,
-    but this would introduce too much overhead in C tokenizer due to the need
-    to check for a bad route after every call to Tokenizer_push.)
+    Tokenizer_push() calls this itself, like the Python tokenizer does, so
+    it only needs to be called directly to fail early, before doing work
+    that comes ahead of the push.
 */
 int
 Tokenizer_check_route(Tokenizer *self, uint64_t context)
 {
-    StackIdent ident = {self->head, context};
-    struct avl_tree_node *node = (struct avl_tree_node *) (&ident + 1);
+    const RouteSet *set = &self->bad_routes;
+
+    if (set->count == 0)
+        return 0;
 
-    if (avl_tree_lookup_node(self->bad_routes, node, compare_nodes)) {
+    StackIdent ident = {self->head, context};
+    if (route_set_find(set, ident)->head != ROUTE_SET_EMPTY) {
         FAIL_ROUTE(context);
         return -1;
     }
@@ -212,25 +689,64 @@ Tokenizer_check_route(Tokenizer *self, uint64_t context)
 }
 
 /*
-    Free the tokenizer's bad route cache tree. Intended to be called by the
-    main tokenizer function after parsing is finished.
+    Forget all bad routes. The table lives in the arena and is released along
+    with it.
 */
 void
-Tokenizer_free_bad_route_tree(Tokenizer *self)
-{
-    struct avl_tree_node *cur = avl_tree_first_in_postorder(self->bad_routes);
-    struct avl_tree_node *parent;
-    while (cur) {
-        route_tree_node *node = avl_tree_entry(cur, route_tree_node, node);
-        parent = avl_get_parent(cur);
-        free(node);
-        cur = avl_tree_next_in_postorder(cur, parent);
+Tokenizer_clear_bad_routes(Tokenizer *self)
+{
+    self->bad_routes.slots = NULL;
+    self->bad_routes.mask = 0;
+    self->bad_routes.count = 0;
+    self->bad_routes.floor = 0;
+    self->bad_routes.pruned = 0;
+}
+
+/*
+    Return the ID of a name, such as a template name or tag name, interned in
+    the tokenizer's table. Surrounding whitespace is not part of the name.
+    Names are usually spans of the input and are interned as they are, and
+    anything else is copied to pinned memory first, as it may not outlive the
+    route it came from. Return 0 for an empty name or if there was no room, in
+    which case the token just goes without an ID.
+*/
+uint32_t
+Tokenizer_intern(memory_arena_t *a, Tokenizer *self, const char *text, size_t length)
+{
+    while (length && char_is(*text, CC_SPACE)) {
+        text++;
+        length--;
+    }
+    while (length && char_is(text[length - 1], CC_SPACE))
+        length--;
+    if (!length)
+        return 0;
+
+    uint32_t id = StringTable_find(&self->names, text, length);
+    if (id)
+        return id;
+
+    int out_of_space = a->out_of_space;
+    const char *data = self->text.data;
+    if (text < data || text + length > data + self->text.length) {
+        char *copy = arena_alloc_pinned(a, length, ARENA_STRINGS);
+        if (!copy) {
+            a->out_of_space = out_of_space;
+            return 0;
+        }
+        memcpy(copy, text, length);
+        text = copy;
     }
-    self->bad_routes = NULL;
+    id = StringTable_add(a, &self->names, text, length);
+    if (!id)
+        a->out_of_space = out_of_space;
+    return id;
 }
 
 /*
-    Write a token to the current token stack.
+    Write a token to the current token stack. A token written first goes in
+    one of the slots reserved before the stack if there is one left, and
+    otherwise the stack's tokens are moved up to make room for it.
 */
 int
 Tokenizer_emit_token(memory_arena_t *a, Tokenizer *self, Token *token, int first)
@@ -243,24 +759,67 @@ Tokenizer_emit_token(memory_arena_t *a, Tokenizer *self, Token *token, int first
     }
 
     assert(self->topstack);
-    assert(self->topstack->tokenlist);
 
-    if (first) {
-        TokenList_prepend(a, self->topstack->tokenlist, token);
+    Stack *top = self->topstack;
+    if (!first || top->len == 0) {
+        return Tokenizer_append(a, self, token);
+    }
+    if (top->reserved) {
+        top->start--;
+        top->reserved--;
     } else {
-        TokenList_append(a, self->topstack->tokenlist, token);
+        if (Tokenizer_make_room(a, self, 1))
+            return 1;
+        Token *tokens = self->tokens.tokens + top->start;
+        memmove(tokens + 1, tokens, top->len * sizeof(Token));
     }
-
+    self->tokens.tokens[top->start] = *token;
+    top->len++;
     return 0;
 }
 
 /*
-    Write a Unicode codepoint to the current textbuffer.
+    Write a Unicode codepoint to the current textbuffer. Text that matches the
+    input where the textbuffer's span ends, or at the head if it is empty,
+    extends the span instead of being copied.
 */
 int
 Tokenizer_emit_char(memory_arena_t *a, Tokenizer *self, char code)
 {
-    return Textbuffer_write(a, self->topstack->textbuffer, code);
+    Textbuffer *buffer = self->topstack->textbuffer;
+    const char *next;
+
+    if (buffer->length == 0) {
+        self->topstack->text_offset = self->head;
+        next = self->text.data + self->head;
+    }
+    else if (buffer->span)
+        next = buffer->span + buffer->length;
+    else
+        return Textbuffer_write(a, buffer, code);
+
+    if (next < self->text.data + self->text.length && *next == code)
+        return Textbuffer_write_span(a, buffer, next, 1);
+    return Textbuffer_write(a, buffer, code);
+}
+
+/*
+    Write length bytes of text to the current textbuffer, referring to them
+    in place if they are part of the input.
+*/
+int
+Tokenizer_emit_run(memory_arena_t *a, Tokenizer *self, const char *text, size_t length)
+{
+    Textbuffer *buffer = self->topstack->textbuffer;
+
+    if (text >= self->text.data && text < self->text.data + self->text.length) {
+        if (buffer->length == 0)
+            self->topstack->text_offset = text - self->text.data;
+        return Textbuffer_write_span(a, buffer, text, length);
+    }
+    if (buffer->length == 0)
+        self->topstack->text_offset = self->head;
+    return Textbuffer_append(a, buffer, text, length);
 }
 
 /*
@@ -287,13 +846,20 @@ Tokenizer_emit_text(memory_arena_t *a, Tokenizer *self, const char *text)
 int
 Tokenizer_emit_textbuffer(memory_arena_t *a, Tokenizer *self, Textbuffer *buffer)
 {
+    if (self->topstack->textbuffer->length == 0) {
+        self->topstack->text_offset =
+            buffer->span ? (size_t) (buffer->span - self->text.data) : self->head;
+    }
     int retval = Textbuffer_concat(a, self->topstack->textbuffer, buffer);
     Textbuffer_dealloc(a, buffer);
     return retval;
 }
 
 /*
-    Write a series of tokens to the current stack at once.
+    Write a series of tokens to the current stack at once. The tokens of a
+    popped stack usually come right after the current stack's own, in which
+    case they become part of it where they are. Otherwise they are moved
+    there in one go.
 */
 int
 Tokenizer_emit_all(memory_arena_t *a, Tokenizer *self, TokenList *tokenlist)
@@ -301,35 +867,61 @@ Tokenizer_emit_all(memory_arena_t *a, Tokenizer *self, TokenList *tokenlist)
     if (self == NULL || tokenlist == NULL)
         return 1;
 
-    if (tokenlist->len > 0 && tokenlist->tokens[0].type == Text) {
-        // We want to merge side-by-side `Text` tokens
-        Token existingText;
-        assert(TokenList_pop_first(tokenlist, &existingText) == Pop_Good);
-        if (Tokenizer_emit_text(a, self, existingText.ctx.data))
+    size_t i = Tokenizer_find_popped(self, tokenlist);
+    if (tokenlist->len > 0 && tokenlist->tokens[0].type == Text &&
+        self->topstack->textbuffer->length) {
+        // A first Text is merged with the text before it. With no text
+        // before it, it is already the token the merge would give.
+        Token *text = &tokenlist->tokens[0];
+        if (Tokenizer_emit_run(a, self, text->ctx.data, text->length))
             return 1;
+        if (i < self->popped_len)
+            self->popped[i].start++;
+        tokenlist->tokens++;
+        tokenlist->len--;
     }
 
-    Tokenizer_push_textbuffer(a, self);
+    if (Tokenizer_push_textbuffer(a, self))
+        return 1;
 
-    for (int i = 0; i < tokenlist->len; i++)
-        TokenList_append(a, self->topstack->tokenlist, &tokenlist->tokens[i]);
+    // The tokens are forgotten first so that making room does not move them
+    // out of the way, and found again after it, as the list may have moved.
+    if (i >= self->popped_len || self->popped[i].tokens != tokenlist)
+        i = Tokenizer_find_popped(self, tokenlist);
+    size_t start = 0;
+    int in_list = i < self->popped_len;
+    if (in_list) {
+        start = self->popped[i].start;
+        Tokenizer_forget_popped(self, i);
+    }
+    if (Tokenizer_make_room(a, self, tokenlist->len))
+        return 1;
 
+    Stack *top = self->topstack;
+    Token *tokens = self->tokens.tokens + top->start + top->len;
+    Token *from = in_list ? self->tokens.tokens + start : tokenlist->tokens;
+    if (tokenlist->len && from != tokens)
+        memmove(tokens, from, tokenlist->len * sizeof(Token));
+    top->len += tokenlist->len;
     return 0;
 }
 
 /*
-    Pop the current stack, write text, and then write the stack. 'text' is a
-    NULL-terminated array of chars.
+    Pop the current stack, write length bytes of text, and then write the
+    stack.
 */
 int
-Tokenizer_emit_text_then_stack(memory_arena_t *a, Tokenizer *self, const char *text)
+Tokenizer_emit_text_then_stack(
+    memory_arena_t *a, Tokenizer *self, const char *text, size_t length)
 {
     TokenList *tl = Tokenizer_pop(a, self);
+    if (!tl)
+        return -1;
 
-    if (Tokenizer_emit_text(a, self, text))
+    if (Tokenizer_emit_run(a, self, text, length))
         return -1;
 
-    if (tl && tl->len > 0) {
+    if (tl->len > 0) {
         if (Tokenizer_emit_all(a, self, tl))
             return -1;
     }
@@ -339,31 +931,31 @@ Tokenizer_emit_text_then_stack(memory_arena_t *a, Tokenizer *self, const char *t
 }
 
 /*
-    Read the value at a relative point in the wikicode, forwards.
-*/
-char
-Tokenizer_read(Tokenizer *self, size_t delta)
-{
-    size_t index = self->head + delta;
-
-    if (index >= self->text.length) {
-        return '\0';
-    }
-
-    return self->text.data[index];
-}
+    Replace the input with a copy that has TOKENIZER_PADDING NUL bytes before
+    and after it, so that the parser reads near its ends without bounds
+    checks. The copy is pinned and lasts until the arena is reset, and the
+    tokens point into it. Input that is padded already is left alone.
 
-/*
-    Read the value at a relative point in the wikicode, backwards.
+    Return 0 on success and -1 if the copy could not be allocated.
 */
-char
-Tokenizer_read_backwards(Tokenizer *self, size_t delta)
+int
+TokenizerInput_pad(memory_arena_t *a, TokenizerInput *input)
 {
-    size_t index;
+    if (input->padded)
+        return 0;
+    if (input->length > SIZE_MAX - 2 * TOKENIZER_PADDING)
+        return -1;
 
-    if (delta > self->head) {
-        return '\0';
-    }
+    char *data =
+        arena_alloc_pinned(a, input->length + 2 * TOKENIZER_PADDING, ARENA_TEXT);
+    if (!data)
+        return -1;
+    memset(data, 0, TOKENIZER_PADDING);
+    if (input->length)
+        memcpy(data + TOKENIZER_PADDING, input->data, input->length);
+    memset(data + TOKENIZER_PADDING + input->length, 0, TOKENIZER_PADDING);
 
-    return self->text.data[self->head - delta];
+    input->data = data + TOKENIZER_PADDING;
+    input->padded = true;
+    return 0;
 }
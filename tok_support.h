@@ -27,25 +27,56 @@ SOFTWARE.
 
 /* Functions */
 
+int Tokenizer_reset(memory_arena_t*, Tokenizer*, const char*, size_t);
 int Tokenizer_push(memory_arena_t*, Tokenizer*, uint64_t);
+int Tokenizer_push_reserving(memory_arena_t*, Tokenizer*, uint64_t, size_t);
 int Tokenizer_push_textbuffer(memory_arena_t*, Tokenizer*);
-void Tokenizer_delete_top_of_stack(memory_arena_t*, Tokenizer*);
+void Tokenizer_delete_top_of_stack(Tokenizer*);
 TokenList* Tokenizer_pop(memory_arena_t*, Tokenizer*);
 TokenList* Tokenizer_pop_keeping_context(memory_arena_t*, Tokenizer*);
 void Tokenizer_memoize_bad_route(memory_arena_t*, Tokenizer*);
 void* Tokenizer_fail_route(memory_arena_t* a, Tokenizer*);
+void Tokenizer_drop_stacks(Tokenizer*, int);
 int Tokenizer_check_route(Tokenizer*, uint64_t);
-void Tokenizer_free_bad_route_tree(Tokenizer*);
+void Tokenizer_clear_bad_routes(Tokenizer*);
+uint32_t Tokenizer_intern(memory_arena_t*, Tokenizer*, const char*, size_t);
 
 int Tokenizer_emit_token(memory_arena_t*, Tokenizer*, Token*, int);
 int Tokenizer_emit_char(memory_arena_t*, Tokenizer*, char);
 int Tokenizer_emit_text(memory_arena_t*, Tokenizer*, const char*);
+int Tokenizer_emit_run(memory_arena_t*, Tokenizer*, const char*, size_t);
 int Tokenizer_emit_textbuffer(memory_arena_t*, Tokenizer*, Textbuffer*);
 int Tokenizer_emit_all(memory_arena_t*, Tokenizer*, TokenList*);
-int Tokenizer_emit_text_then_stack(memory_arena_t*, Tokenizer*, const char*);
+int Tokenizer_emit_text_then_stack(memory_arena_t*, Tokenizer*, const char*, size_t);
 
-char Tokenizer_read(Tokenizer*, size_t);
-char Tokenizer_read_backwards(Tokenizer*, size_t);
+int TokenizerInput_pad(memory_arena_t*, TokenizerInput*);
+
+/*
+    Read the value at a relative point in the wikicode, forwards. Padded input
+    is read as is for the short distances the parser looks ahead.
+*/
+static inline char Tokenizer_read(Tokenizer* self, size_t delta)
+{
+    size_t index = self->head + delta;
+
+    if (self->text.padded && delta < TOKENIZER_PADDING)
+        return self->text.data[index];
+    if (index >= self->text.length)
+        return '\0';
+    return self->text.data[index];
+}
+
+/*
+    Read the value at a relative point in the wikicode, backwards.
+*/
+static inline char Tokenizer_read_backwards(Tokenizer* self, size_t delta)
+{
+    if (self->text.padded && delta <= TOKENIZER_PADDING)
+        return self->text.data[(ptrdiff_t) self->head - (ptrdiff_t) delta];
+    if (delta > self->head)
+        return '\0';
+    return self->text.data[self->head - delta];
+}
 
 /* Macros */
 
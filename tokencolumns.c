@@ -0,0 +1,55 @@
+#include "tokencolumns.h"
+#include "common.h"
+#include "memoryarena.h"
+
+/*
+    Lay out the given tokens column by column. The columns share a single
+    allocation, and the texts still refer to the same memory as the tokens.
+*/
+TokenColumns *
+TokenColumns_new(memory_arena_t *a, const TokenList *tokens)
+{
+    size_t texts_len = 0;
+    for (size_t i = 0; i < tokens->len; i++)
+        texts_len += tokens->tokens[i].type == Text;
+
+    // Widest columns first, so that each one stays aligned.
+    size_t size = sizeof(TokenColumns) + texts_len * sizeof(const char *) +
+                  (texts_len + tokens->len) * sizeof(uint32_t) + tokens->len;
+    TokenColumns *self = arena_alloc(a, size, ARENA_TOKENLIST);
+    if (!self)
+        return NULL;
+    self->texts = (const char **) (self + 1);
+    self->lengths = (uint32_t *) (self->texts + texts_len);
+    self->ctx = self->lengths + texts_len;
+    self->types = (uint8_t *) (self->ctx + tokens->len);
+    self->len = tokens->len;
+    self->texts_len = texts_len;
+
+    size_t n = 0;
+    for (size_t i = 0; i < tokens->len; i++) {
+        const Token *token = &tokens->tokens[i];
+        self->types[i] = token->type;
+        self->ctx[i] = Token_payload(token);
+        if (token->type == Text) {
+            self->texts[n] = token->ctx.data;
+            self->lengths[n] = token->length;
+            n++;
+        }
+    }
+    return self;
+}
+
+/*
+    Return the number of tokens of the given type.
+*/
+size_t
+TokenColumns_count(const TokenColumns *self, TokenType type)
+{
+    size_t count = 0;
+
+    // Kept branch-free so that the compiler can vectorize it.
+    for (size_t i = 0; i < self->len; i++)
+        count += self->types[i] == type;
+    return count;
+}
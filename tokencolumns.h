@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "memoryarena.h"
+
+/*
+    Tokens stored column by column rather than as an array of Token. The type
+    of every token is one byte, and the payload of the tokens that have one
+    (heading level, quote character, bracket/space flag or name id, as given
+    by Token_payload()) is a number at the same index. Text tokens also have
+    their text in texts and lengths, in the order they appear, so the n-th
+    Text token's text is texts[n].
+
+    Passes that only look at the kinds of tokens scan a byte per token, and
+    the whole output takes a fraction of the size of the tokens it came from.
+*/
+typedef struct {
+    uint8_t* types; /* TokenType of each token */
+    uint32_t* ctx; /* payload of each token, 0 for tokens without one */
+    const char** texts; /* text of each Text token */
+    uint32_t* lengths; /* length of each Text token's text */
+    size_t len; /* number of tokens */
+    size_t texts_len; /* number of Text tokens */
+} TokenColumns;
+
+TokenColumns* TokenColumns_new(memory_arena_t*, const TokenList*);
+size_t TokenColumns_count(const TokenColumns*, TokenType);
@@ -0,0 +1,320 @@
+#include "tokenfile.h"
+#include "common.h"
+#include "memoryarena.h"
+#include "tokenlist.h"
+#ifdef TOKEN_FILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define TOKEN_FILE_BYTE_ORDER 0x0102
+#define TOKEN_FILE_PAGES      16
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+
+/*
+    Return the size of a page's block, or 0 if it would not fit in size bytes.
+*/
+static uint64_t
+block_size(uint64_t len, uint64_t texts_size, uint64_t size)
+{
+    if (len > size / sizeof(TokenFileSpan) || texts_size > size)
+        return 0;
+    return ALIGN8(len) + len * sizeof(TokenFileSpan) + ALIGN8(len * 4) +
+           ALIGN8(texts_size);
+}
+
+/*
+    Write zeros up to the next multiple of 8 for something size bytes long.
+    Return -1 if they could not be written.
+*/
+static int
+write_padding(FILE *file, uint64_t size)
+{
+    static const char zeros[8];
+    size_t padding = (size_t) (ALIGN8(size) - size);
+
+    return padding && fwrite(zeros, 1, padding, file) != padding ? -1 : 0;
+}
+
+/*
+    Write size bytes of data and pad them to a multiple of 8. Return -1 if
+    they could not be written.
+*/
+static int
+write_aligned(FILE *file, const void *data, size_t size)
+{
+    if (size && fwrite(data, 1, size, file) != size)
+        return -1;
+    return write_padding(file, size);
+}
+
+/*
+    Create the file at path and start writing pages to it. Return -1 if it
+    could not be created.
+*/
+int
+TokenFileWriter_open(TokenFileWriter *self, const char *path)
+{
+    TokenFileHeader header = {0};
+
+    self->file = fopen(path, "wb");
+    if (!self->file)
+        return -1;
+    self->pages = NULL;
+    self->len = 0;
+    self->size = 0;
+    self->end = sizeof(TokenFileHeader);
+
+    // The header is written for real once the directory's place is known.
+    if (write_aligned(self->file, &header, sizeof(header))) {
+        fclose(self->file);
+        self->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Write the columns and text of a page's tokens as its block.
+*/
+static int
+write_block(memory_arena_t *a, FILE *file, const TokenList *tokens, uint64_t texts_size)
+{
+    size_t len = tokens->len;
+
+    // The columns are built in one allocation, widest first so that each one
+    // stays aligned, and written in the file's order.
+    size_t size = len * (sizeof(TokenFileSpan) + sizeof(uint32_t) + 1);
+    TokenFileSpan *spans = arena_alloc(a, size ? size : 1, ARENA_OTHER);
+    if (!spans)
+        return -1;
+    uint32_t *payloads = (uint32_t *) (spans + len);
+    uint8_t *types = (uint8_t *) (payloads + len);
+
+    uint32_t text = 0;
+    for (size_t i = 0; i < len; i++) {
+        const Token *token = &tokens->tokens[i];
+        types[i] = token->type;
+        spans[i].offset = (uint32_t) token->offset;
+        spans[i].text = 0;
+        payloads[i] = Token_payload(token);
+        if (token->type == Text) {
+            spans[i].text = text;
+            payloads[i] = token->length;
+            text += token->length;
+        }
+    }
+    int err = write_aligned(file, types, len) ||
+              write_aligned(file, spans, len * sizeof(TokenFileSpan)) ||
+              write_aligned(file, payloads, len * sizeof(uint32_t));
+    arena_free(a, spans);
+
+    for (size_t i = 0; !err && i < len; i++) {
+        const Token *token = &tokens->tokens[i];
+        if (token->type == Text && token->length)
+            err = fwrite(token->ctx.data, 1, token->length, file) != token->length;
+    }
+    return err || write_padding(file, texts_size) ? -1 : 0;
+}
+
+/*
+    Write the tokens of a page that were read from an input of the given
+    length. The arena is only used while the page is written, so it can be
+    reset between pages. Return -1 if the page could not be written or is too
+    large for the format, in which case the file should be given up on.
+*/
+int
+TokenFileWriter_add(memory_arena_t *a,
+                    TokenFileWriter *self,
+                    const TokenList *tokens,
+                    size_t length)
+{
+    uint64_t texts_size = 0;
+
+    for (size_t i = 0; i < tokens->len; i++) {
+        const Token *token = &tokens->tokens[i];
+        if (token->offset > UINT32_MAX)
+            return -1;
+        if (token->type == Text)
+            texts_size += token->length;
+    }
+    if (texts_size > UINT32_MAX)
+        return -1;
+
+    if (self->len == self->size) {
+        size_t size = self->size ? self->size * 2 : TOKEN_FILE_PAGES;
+        TokenFilePage *pages = NULL;
+        if (size <= SIZE_MAX / sizeof(TokenFilePage))
+            pages = realloc(self->pages, size * sizeof(TokenFilePage));
+        if (!pages)
+            return -1;
+        self->pages = pages;
+        self->size = size;
+    }
+
+    if (write_block(a, self->file, tokens, texts_size))
+        return -1;
+    TokenFilePage *page = &self->pages[self->len++];
+    page->block = self->end;
+    page->len = tokens->len;
+    page->texts_size = texts_size;
+    page->length = length;
+    self->end += block_size(tokens->len, texts_size, UINT64_MAX);
+    return 0;
+}
+
+/*
+    Write the page directory and the header, and close the file. Return -1 if
+    either could not be written, in which case the file is not usable. The
+    writer has to be closed even after a page could not be added.
+*/
+int
+TokenFileWriter_close(TokenFileWriter *self)
+{
+    TokenFileHeader header = {0};
+
+    memcpy(header.magic, TOKEN_FILE_MAGIC, sizeof(TOKEN_FILE_MAGIC));
+    header.version = TOKEN_FILE_VERSION;
+    header.byte_order = TOKEN_FILE_BYTE_ORDER;
+    header.pages = self->len;
+    header.directory = self->end;
+
+    size_t size = self->len * sizeof(TokenFilePage);
+    int err = write_aligned(self->file, self->pages, size) ||
+              fseek(self->file, 0, SEEK_SET) ||
+              write_aligned(self->file, &header, sizeof(header));
+    err |= fclose(self->file) != 0;
+    free(self->pages);
+    self->file = NULL;
+    self->pages = NULL;
+    return err ? -1 : 0;
+}
+
+#ifdef TOKEN_FILE_MMAP
+/*
+    Map the file at path and check that it is a token file this version can
+    read. Its pages are checked as they are opened. Return -1 if it could not
+    be mapped or is not a valid token file.
+*/
+int
+TokenFile_open(TokenFile *self, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) || (uint64_t) st.st_size < sizeof(TokenFileHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    self->data = data;
+    self->size = (size_t) st.st_size;
+
+    const TokenFileHeader *header = data;
+    if (memcmp(header->magic, TOKEN_FILE_MAGIC, sizeof(TOKEN_FILE_MAGIC)) ||
+        header->version != TOKEN_FILE_VERSION ||
+        header->byte_order != TOKEN_FILE_BYTE_ORDER || header->directory % 8 ||
+        header->directory > self->size ||
+        header->pages > (self->size - header->directory) / sizeof(TokenFilePage)) {
+        TokenFile_close(self);
+        return -1;
+    }
+    self->pages = (const TokenFilePage *) (self->data + header->directory);
+    self->len = header->pages;
+    return 0;
+}
+
+/*
+    Unmap the file. Pages taken from it must not be used afterwards.
+*/
+void
+TokenFile_close(TokenFile *self)
+{
+    munmap((void *) self->data, self->size);
+    self->data = NULL;
+    self->size = 0;
+    self->pages = NULL;
+    self->len = 0;
+}
+#endif
+
+/*
+    Open the page with the given index, checking that its tokens stay within
+    the file. Return -1 if there is no such page or it is not valid.
+*/
+int
+TokenFile_page(const TokenFile *self, size_t index, TokenPage *page)
+{
+    if (index >= self->len)
+        return -1;
+    const TokenFilePage *entry = &self->pages[index];
+    uint64_t size = block_size(entry->len, entry->texts_size, self->size);
+    if (!size || entry->block % 8 || entry->block > self->size ||
+        size > self->size - entry->block) {
+        return -1;
+    }
+
+    const char *block = self->data + entry->block;
+    page->types = (const uint8_t *) block;
+    page->spans = (const TokenFileSpan *) (block + ALIGN8(entry->len));
+    page->payloads = (const uint32_t *) (page->spans + entry->len);
+    page->texts = (const char *) page->payloads + ALIGN8(entry->len * 4);
+    page->len = entry->len;
+    page->length = entry->length;
+
+    for (size_t i = 0; i < page->len; i++) {
+        if (page->types[i] > TagCloseClose)
+            return -1;
+        if (page->types[i] == Text &&
+            (uint64_t) page->spans[i].text + page->payloads[i] > entry->texts_size) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Read the token with the given index from a page. A Text token's text
+    points into the mapped file.
+*/
+void
+TokenPage_get(const TokenPage *self, size_t index, Token *token)
+{
+    token->type = self->types[index];
+    token->offset = self->spans[index].offset;
+    token->length = 0;
+    token->ctx.data = NULL;
+    if (token->type == Text) {
+        token->length = self->payloads[index];
+        token->ctx.data = (void *) (self->texts + self->spans[index].text);
+    } else if (self->payloads[index]) {
+        Token_set_payload(token, self->payloads[index]);
+    }
+}
+
+/*
+    Decode all the tokens of a page into a new list, for code that wants a
+    TokenList. Unlike TokenPage_get(), this copies every token into the
+    arena; only their text still points into the mapped file. Return NULL if
+    the list could not be allocated.
+*/
+TokenList *
+TokenPage_decode(memory_arena_t *a, const TokenPage *self)
+{
+    TokenList *list = TokenList_new(a, self->len ? self->len : 1);
+    if (!list)
+        return NULL;
+
+    for (size_t i = 0; i < self->len; i++)
+        TokenPage_get(self, i, &list->tokens[i]);
+    list->len = self->len;
+    return list;
+}
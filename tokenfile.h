@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+#include "memoryarena.h"
+#include <stdio.h>
+
+/*
+    A file of parsed pages, laid out so that it can be mapped into memory and
+    read in place. Every offset in it is from the start of the file, so it can
+    be mapped anywhere, and all numbers are in the byte order of the machine
+    that wrote it, which the header records.
+
+    The file starts with a TokenFileHeader. Each page follows as a block that
+    holds, in order and each aligned to 8 bytes:
+        - the type of each token, one byte each;
+        - a TokenFileSpan for each token;
+        - the payload of each token from Token_payload(), 4 bytes each,
+          which for a Text token is the length of its text instead;
+        - the text of the page's Text tokens, one after another.
+    The page directory comes last, with a TokenFilePage for each page.
+*/
+
+#define TOKEN_FILE_MAGIC   "MWFHTOK"
+#define TOKEN_FILE_VERSION 1
+
+/* Files can only be mapped where mmap() is available. */
+#if defined(__unix__) || defined(__APPLE__)
+#define TOKEN_FILE_MMAP
+#endif
+
+typedef struct {
+    char magic[8]; /* TOKEN_FILE_MAGIC */
+    uint16_t version; /* TOKEN_FILE_VERSION */
+    uint16_t byte_order; /* 0x0102 as written by the machine that wrote it */
+    uint32_t reserved;
+    uint64_t pages; /* number of pages */
+    uint64_t directory; /* offset of the page directory */
+} TokenFileHeader;
+
+typedef struct {
+    uint32_t offset; /* where the token starts in the page's input */
+    uint32_t text; /* where a Text token's text starts in the page's texts */
+} TokenFileSpan;
+
+typedef struct {
+    uint64_t block; /* offset of the page's block */
+    uint64_t len; /* number of tokens */
+    uint64_t texts_size; /* number of bytes of text */
+    uint64_t length; /* length of the page's input */
+} TokenFilePage;
+
+/*
+    One page of a mapped file. It refers to the mapping, which must stay open
+    while it is used. TokenPage_get() reads a token straight from it, while
+    TokenPage_decode() copies them all into a TokenList.
+*/
+typedef struct {
+    const uint8_t* types;
+    const TokenFileSpan* spans;
+    const uint32_t* payloads;
+    const char* texts;
+    size_t len; /* number of tokens */
+    size_t length; /* length of the page's input */
+} TokenPage;
+
+typedef struct {
+    FILE* file;
+    TokenFilePage* pages; /* directory so far, from malloc() */
+    size_t len; /* number of pages written */
+    size_t size; /* number of pages allocated */
+    uint64_t end; /* offset where the next block goes */
+} TokenFileWriter;
+
+typedef struct {
+    const char* data; /* the mapped file */
+    size_t size; /* its size in bytes */
+    const TokenFilePage* pages;
+    size_t len; /* number of pages */
+} TokenFile;
+
+int TokenFileWriter_open(TokenFileWriter*, const char* path);
+int TokenFileWriter_add(memory_arena_t*, TokenFileWriter*, const TokenList*,
+                        size_t length);
+int TokenFileWriter_close(TokenFileWriter*);
+
+#ifdef TOKEN_FILE_MMAP
+int TokenFile_open(TokenFile*, const char* path);
+void TokenFile_close(TokenFile*);
+#endif
+int TokenFile_page(const TokenFile*, size_t index, TokenPage*);
+
+void TokenPage_get(const TokenPage*, size_t index, Token*);
+TokenList* TokenPage_decode(memory_arena_t*, const TokenPage*);
@@ -5,46 +5,70 @@
 #define INITIAL_CAPACITY 32
 #define RESIZE_FACTOR    2
 
+/*
+    Create a token list with room for the given number of tokens, or a default
+    number if it is 0.
+*/
 TokenList *
 TokenList_new(memory_arena_t *a, size_t capacity)
 {
-    TokenList *tl = arena_alloc(a, sizeof(TokenList));
-    tl->tokens = arena_alloc(a, INITIAL_CAPACITY * sizeof(Token));
-    tl->len = 0;
-    if (capacity != 0) {
-        tl->capacity = capacity;
-    } else {
-        tl->capacity = INITIAL_CAPACITY;
+    if (capacity == 0)
+        capacity = INITIAL_CAPACITY;
+    if (capacity > SIZE_MAX / sizeof(Token))
+        return NULL;
+
+    TokenList *tl = arena_alloc(a, sizeof(TokenList), ARENA_TOKENLIST);
+    if (!tl)
+        return NULL;
+    tl->tokens = arena_alloc(a, capacity * sizeof(Token), ARENA_TOKENLIST);
+    if (!tl->tokens) {
+        arena_free(a, tl);
+        return NULL;
     }
+    tl->len = 0;
+    tl->capacity = capacity;
 
     return tl;
 }
 
-static inline void
+void
+TokenList_dealloc(memory_arena_t *a, TokenList *tl)
+{
+    arena_free(a, tl->tokens);
+    arena_free(a, tl);
+}
+
+static inline int
 TokenList_resize(memory_arena_t *a, TokenList *tl)
 {
+    Token *tokens =
+        arena_reallocarray(a, tl->tokens, tl->capacity * RESIZE_FACTOR, sizeof(Token));
+    if (!tokens)
+        return 1;
+    tl->tokens = tokens;
     tl->capacity = tl->capacity * RESIZE_FACTOR;
-    tl->tokens = arena_reallocarray(a, tl->tokens, tl->capacity, sizeof(Token));
+    return 0;
 }
 
-void
+int
 TokenList_append(memory_arena_t *a, TokenList *tl, Token *t)
 {
-    if (tl->len == tl->capacity)
-        TokenList_resize(a, tl);
+    if (tl->len == tl->capacity && TokenList_resize(a, tl))
+        return 1;
 
     tl->tokens[tl->len] = *t;
     tl->len++;
+    return 0;
 }
 
-void
+int
 TokenList_prepend(memory_arena_t *a, TokenList *tl, Token *t)
 {
     if (tl->len == 0)
         return TokenList_append(a, tl, t);
 
-    if (tl->len == tl->capacity)
-        TokenList_resize(a, tl);
+    if (tl->len == tl->capacity && TokenList_resize(a, tl))
+        return 1;
 
     for (int i = tl->len; i > 0; i--)
         tl->tokens[i] = tl->tokens[i - 1];
@@ -53,7 +77,7 @@ TokenList_prepend(memory_arena_t *a, TokenList *tl, Token *t)
 
     tl->len++;
 
-    return;
+    return 0;
 }
 
 PopResult
@@ -91,3 +115,97 @@ TokenList_pop_first(TokenList *self, Token *t)
 
     return Pop_Good;
 }
+
+/*
+    Return the token that closes a construct opened by the given type, or
+    Text if the type does not open one. Tags opened with TagOpenOpen are
+    closed by either TagCloseClose or TagCloseSelfclose.
+*/
+static inline TokenType
+TokenList_closer(TokenType type)
+{
+    switch (type) {
+    case ItalicOpen:
+        return ItalicClose;
+    case BoldOpen:
+        return BoldClose;
+    case TemplateOpen:
+        return TemplateClose;
+    case ArgumentOpen:
+        return ArgumentClose;
+    case WikilinkOpen:
+        return WikilinkClose;
+    case ExternalLinkOpen:
+        return ExternalLinkClose;
+    case HTMLEntityStart:
+        return HTMLEntityEnd;
+    case HeadingStart:
+        return HeadingEnd;
+    case CommentStart:
+        return CommentEnd;
+    case TagOpenOpen:
+        return TagCloseClose;
+    default:
+        return Text;
+    }
+}
+
+static inline int
+TokenList_closes(TokenType open, TokenType close)
+{
+    TokenType closer = TokenList_closer(open);
+    return close == closer || (closer == TagCloseClose && close == TagCloseSelfclose);
+}
+
+#define NO_MATCH UINT32_MAX
+
+/*
+    Build an index that maps the token opening each construct to the one
+    closing it and back, so that a construct can be skipped or measured
+    without matching the tokens in between. Tokens that are not part of a
+    pair map to themselves. Return NULL if it could not be allocated or the
+    list has too many tokens to be indexed by 32 bits.
+*/
+uint32_t *
+TokenList_match(memory_arena_t *a, const TokenList *tl)
+{
+    if (tl->len >= NO_MATCH)
+        return NULL;
+    uint32_t *match = arena_alloc(a, (tl->len ? tl->len : 1) * sizeof(uint32_t),
+                                  ARENA_TOKENLIST);
+    if (!match)
+        return NULL;
+
+    // The openers that are not closed yet form a stack, linked through
+    // their own entries.
+    uint32_t top = NO_MATCH;
+    for (uint32_t i = 0; i < tl->len; i++) {
+        TokenType type = tl->tokens[i].type;
+        match[i] = i;
+        if (TokenList_closer(type) != Text) {
+            match[i] = top;
+            top = i;
+            continue;
+        }
+        uint32_t open = top;
+        while (open != NO_MATCH && !TokenList_closes(tl->tokens[open].type, type))
+            open = match[open];
+        if (open == NO_MATCH)
+            continue;
+        // Openers left inside the pair were never closed.
+        while (top != open) {
+            uint32_t next = match[top];
+            match[top] = top;
+            top = next;
+        }
+        top = match[open];
+        match[open] = i;
+        match[i] = open;
+    }
+    while (top != NO_MATCH) {
+        uint32_t next = match[top];
+        match[top] = top;
+        top = next;
+    }
+    return match;
+}
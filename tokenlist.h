@@ -4,10 +4,10 @@
 #include "memoryarena.h"
 
 TokenList* TokenList_new(memory_arena_t*, size_t capacity);
-void TokenList_deinit(TokenList*);
-void TokenList_append(memory_arena_t*, TokenList*, Token*);
+void TokenList_dealloc(memory_arena_t*, TokenList*);
+int TokenList_append(memory_arena_t*, TokenList*, Token*);
 /// Expensive. Avoid.
-void TokenList_prepend(memory_arena_t*, TokenList*, Token*);
+int TokenList_prepend(memory_arena_t*, TokenList*, Token*);
 
 typedef enum {
     Pop_Good = 0,
@@ -15,4 +15,5 @@ typedef enum {
 } PopResult;
 
 PopResult Tokenlist_pop(TokenList*, Token*);
-PopResult TokenList_pop_first(TokenList*, Token*);
\ No newline at end of file
+PopResult TokenList_pop_first(TokenList*, Token*);
+uint32_t* TokenList_match(memory_arena_t*, const TokenList*);
\ No newline at end of file
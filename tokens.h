@@ -24,6 +24,7 @@ SOFTWARE.
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef enum {
     Text,
@@ -148,23 +149,89 @@ typedef struct {
     char quote;
 } TagAttrQuoteContext;
 
+typedef struct {
+    uint32_t id; /* interned by the tokenizer, 0 if the name is not plain text */
+} NameContext;
+
 typedef struct {
     TokenType type;
+    // Length of a Text token's text, which is not NUL terminated. It is often
+    // a run of the input itself rather than a copy, so it must not be modified.
+    uint32_t length;
+    // Where the token starts in the input. Tokens that stand for markup start
+    // where the markup does, and Text tokens where their text came from.
+    size_t offset;
 
     union {
         ExternalLinkSeparatorContext external_link_sep;
         ExternalLinkOpenContext external_link_open;
         HeadingContext heading;
         TagAttrQuoteContext tag_attr_quote;
+        NameContext name; // TemplateOpen, TemplateParamEquals and TagOpenOpen
         void* data; // default
     } ctx;
 } Token;
 
+/*
+    Return the payload of a token as a number, or 0 if it has none. Every
+    layout that stores tokens as something other than Token (the columns,
+    streams and files) takes the payload from here, so that a new kind of
+    payload only has to be added in one place.
+*/
+static inline uint32_t Token_payload(const Token* token)
+{
+    switch (token->type) {
+    case ExternalLinkOpen:
+        return token->ctx.external_link_open.brackets;
+    case ExternalLinkSeparator:
+        return token->ctx.external_link_sep.space;
+    case HeadingStart:
+        return (unsigned char) token->ctx.heading.level;
+    case TagAttrQuote:
+        return (unsigned char) token->ctx.tag_attr_quote.quote;
+    case TemplateOpen:
+    case TemplateParamEquals:
+    case TagOpenOpen:
+        return token->ctx.name.id;
+    default:
+        return 0;
+    }
+}
+
+/*
+    Give a token the payload returned by Token_payload(). Only tokens that
+    can have one may be given one.
+*/
+static inline void Token_set_payload(Token* token, uint32_t payload)
+{
+    switch (token->type) {
+    case ExternalLinkOpen:
+        token->ctx.external_link_open.brackets = payload;
+        break;
+    case ExternalLinkSeparator:
+        token->ctx.external_link_sep.space = payload;
+        break;
+    case HeadingStart:
+        token->ctx.heading.level = (char) payload;
+        break;
+    case TagAttrQuote:
+        token->ctx.tag_attr_quote.quote = (char) payload;
+        break;
+    default:
+        token->ctx.name.id = payload;
+        break;
+    }
+}
+
 #define TOKEN(variable_name, type_value) \
     Token variable_name;                 \
     variable_name.type = type_value;     \
-    variable_name.ctx.data = NULL;
+    variable_name.ctx.data = NULL;       \
+    variable_name.length = 0;            \
+    variable_name.offset = self->head;
 
 #define TOKEN_CTX(variable_name, type_value) \
     Token variable_name;                     \
-    variable_name.type = type_value;
+    variable_name.type = type_value;         \
+    variable_name.length = 0;                \
+    variable_name.offset = self->head;
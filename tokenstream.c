@@ -0,0 +1,183 @@
+#include "tokenstream.h"
+#include "common.h"
+#include "memoryarena.h"
+#include "tokenlist.h"
+
+#define TOKEN_STREAM_TYPE    0x3f
+#define TOKEN_STREAM_PAYLOAD 0x40
+
+/*
+    Return the number of bytes that the value takes as a varint.
+*/
+static inline size_t
+varint_size(uint64_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline uint8_t *
+varint_write(uint8_t *code, uint64_t value)
+{
+    while (value >= 0x80) {
+        *code++ = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    *code++ = (uint8_t) value;
+    return code;
+}
+
+static inline const uint8_t *
+varint_read(const uint8_t *code, uint64_t *value)
+{
+    // Most values fit in a single byte.
+    if (*code < 0x80) {
+        *value = *code;
+        return code + 1;
+    }
+    uint64_t result = 0;
+    int shift = 0;
+    while (*code >= 0x80) {
+        result |= (uint64_t) (*code++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *value = result | (uint64_t) *code << shift;
+    return code + 1;
+}
+
+/*
+    Return the distance between two offsets as an unsigned value, small when
+    the distance is small either way. The tokens mostly follow the input, but
+    their offsets are not guaranteed to only go up.
+*/
+static inline uint64_t
+offset_delta(size_t offset, size_t last)
+{
+    int64_t delta = (int64_t) (offset - last);
+    return ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+}
+
+/*
+    Pack the given tokens into a stream. The stream takes a single allocation
+    and does not refer to the tokens or their text afterwards. Return NULL if
+    it could not be allocated.
+*/
+TokenStream *
+TokenStream_new(memory_arena_t *a, const TokenList *tokens)
+{
+    size_t codes_size = 0, texts_size = 0, last = 0;
+
+    for (size_t i = 0; i < tokens->len; i++) {
+        const Token *token = &tokens->tokens[i];
+        uint32_t payload = Token_payload(token);
+        codes_size += 1 + varint_size(offset_delta(token->offset, last));
+        if (token->type == Text) {
+            codes_size += varint_size(token->length);
+            texts_size += token->length;
+        }
+        if (payload)
+            codes_size += varint_size(payload);
+        last = token->offset;
+    }
+
+    size_t size = sizeof(TokenStream) + codes_size + texts_size;
+    TokenStream *self = arena_alloc(a, size, ARENA_TOKENLIST);
+    if (!self)
+        return NULL;
+    uint8_t *code = (uint8_t *) (self + 1);
+    char *text = (char *) code + codes_size;
+    self->codes = code;
+    self->texts = text;
+    self->codes_size = codes_size;
+    self->texts_size = texts_size;
+    self->len = tokens->len;
+
+    last = 0;
+    for (size_t i = 0; i < tokens->len; i++) {
+        const Token *token = &tokens->tokens[i];
+        uint32_t payload = Token_payload(token);
+        *code++ = token->type | (payload ? TOKEN_STREAM_PAYLOAD : 0);
+        code = varint_write(code, offset_delta(token->offset, last));
+        if (token->type == Text) {
+            code = varint_write(code, token->length);
+            if (token->length)
+                memcpy(text, token->ctx.data, token->length);
+            text += token->length;
+        }
+        if (payload)
+            code = varint_write(code, payload);
+        last = token->offset;
+    }
+    return self;
+}
+
+/*
+    Start reading the tokens of a stream from the first one.
+*/
+void
+TokenStream_begin(const TokenStream *self, TokenStreamReader *reader)
+{
+    reader->code = self->codes;
+    reader->text = self->texts;
+    reader->offset = 0;
+    reader->left = self->len;
+}
+
+/*
+    Decode the next token of a stream into token. A Text token's text points
+    into the stream. Return 1 if there was a token and 0 at the end.
+*/
+int
+TokenStream_next(TokenStreamReader *reader, Token *token)
+{
+    if (!reader->left)
+        return 0;
+    reader->left--;
+
+    const uint8_t *code = reader->code;
+    uint8_t head = *code++;
+    uint64_t value;
+
+    token->type = head & TOKEN_STREAM_TYPE;
+    token->length = 0;
+    token->ctx.data = NULL;
+
+    code = varint_read(code, &value);
+    reader->offset += (size_t) ((value >> 1) ^ -(value & 1));
+    token->offset = reader->offset;
+
+    if (token->type == Text) {
+        code = varint_read(code, &value);
+        token->length = (uint32_t) value;
+        token->ctx.data = (void *) reader->text;
+        reader->text += value;
+    }
+    if (head & TOKEN_STREAM_PAYLOAD) {
+        code = varint_read(code, &value);
+        Token_set_payload(token, (uint32_t) value);
+    }
+    reader->code = code;
+    return 1;
+}
+
+/*
+    Decode all the tokens of a stream into a new list. Their text still points
+    into the stream. Return NULL if the list could not be allocated.
+*/
+TokenList *
+TokenStream_decode(memory_arena_t *a, const TokenStream *self)
+{
+    TokenList *list = TokenList_new(a, self->len ? self->len : 1);
+    if (!list)
+        return NULL;
+
+    TokenStreamReader reader;
+    TokenStream_begin(self, &reader);
+    while (TokenStream_next(&reader, &list->tokens[list->len]))
+        list->len++;
+    return list;
+}
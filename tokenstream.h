@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.h"
+#include "memoryarena.h"
+
+/*
+    Tokens packed into a stream of bytes, for keeping parsed pages around at a
+    fraction of the size of their tokens. Each token is a byte holding its type
+    and whether a payload follows, then the distance from the previous token's
+    offset, then the length of its text if it is a Text token and its payload
+    from Token_payload() if it has one, all as varints. The text of every Text token is copied into
+    texts, one after another, so the stream does not refer to the input.
+
+    Tokens are read back in order with a TokenStreamReader, which decodes them
+    one at a time, or all at once with TokenStream_decode().
+*/
+typedef struct {
+    const uint8_t* codes; /* encoded tokens */
+    const char* texts; /* text of every Text token */
+    size_t codes_size; /* number of bytes in codes */
+    size_t texts_size; /* number of bytes in texts */
+    size_t len; /* number of tokens */
+} TokenStream;
+
+typedef struct {
+    const uint8_t* code; /* where the next token is encoded */
+    const char* text; /* where the next Text token's text is */
+    size_t offset; /* offset of the token read last */
+    size_t left; /* number of tokens not read yet */
+} TokenStreamReader;
+
+TokenStream* TokenStream_new(memory_arena_t*, const TokenList*);
+void TokenStream_begin(const TokenStream*, TokenStreamReader*);
+int TokenStream_next(TokenStreamReader*, Token*);
+TokenList* TokenStream_decode(memory_arena_t*, const TokenStream*);